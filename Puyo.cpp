@@ -1,15 +1,22 @@
 #include <iostream>
 #include <vector>
 #include <cstdio>
+#include <cstdlib>
 #include <time.h>
 #include <algorithm>
-#include <sstream>
+#include <cassert>
+#include <cstring>
+#include <atomic>
+#include <thread>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_mixer.h>
 #include <SDL/SDL_ttf.h>
 #include <SDL/SDL_gfxPrimitives.h>
 
+#include "PuyoCore.h"
+#include "PuyoAI.h"
+
 #define SCR_W 800
 #define SCR_H 440
 #define SCR_BPP 32
@@ -17,71 +24,219 @@
 // Types /////////////////////////////////////////////////
 //////////////////////////////////////////////////////////
 
-enum Direction{ LEFT = 0, RIGHT, UP, DOWN, ROTATE};
-enum PieceColor{ BLUE, GREEN, ORANGE, YELLOW, PURPLE, OJAMM };
-enum PlayerType { NONE, HUM, CPU };
-
-
 bool mixer_on;
 bool font_on;
 
-/* Partcles are created when we linka chain, for funsies */
-struct Particle{
-	Uint32 color;
-	Uint32 created_at;
-	Uint32 time_to_live;
-	int x,y,x_vel,y_vel;
+/* Every puyo drawn once, a piece-sized cell per PieceColor side by side,
+ * so drawing a board is a blit per piece instead of three rasterized
+ * circles. Redrawn whenever the piece size it was made for changes. */
+struct SpriteAtlas{
+	SDL_Surface *surface;
+	unsigned piece_width;
+	unsigned piece_height;
 };
 
-struct Piece{
-	PieceColor color;
-	bool falling;
-	int x, y, w, h;
+SpriteAtlas puyo_sprites;
+
+/* Everything behind the puyos that only changes with the layout: the
+ * background color and the board grids, composited once in the screen's
+ * own pixel format. Frames start from copies of it. */
+struct BackgroundLayer{
+	SDL_Surface *surface;
+	int screen_w, screen_h;    // what it was drawn for
+	unsigned player_count, columns;
+	unsigned board_w, board_h; // in px
 };
 
-/* A couple are two active pieces that fall in tandum. */
-struct Couple{
-	Piece *p[2];
+BackgroundLayer background;
+
+/* Threads the boards of whichever match is on are stepped over; NULL on a
+ * single core. Made once, before the first match. */
+BoardPool *board_pool;
+
+/* Chains the CPU seats have played out, kept from one match to the next.
+ * Made once, alongside board_pool. */
+TranspositionTable *search_table;
+static const std::size_t search_table_bytes = 16 << 20;
+
+/* Helper threads the CPU seats think on in the background, one per core
+ * beyond the two the drawing and the simulation need but always at least
+ * one. Made once, alongside board_pool, with a search for every seat. */
+SearchPool *search_pool;
+
+/* Partcles are created when we linka chain, for funsies. They live in
+ * fixed parallel arrays: the update is one straight loop the compiler can
+ * vectorize, and a dead particle is replaced by the last live one. Past
+ * limit new particles are simply not made. */
+struct ParticlePool{
+	static const unsigned capacity = 1024;
+
+	unsigned count;
+	unsigned limit;     // at most capacity
+	Uint32 last_update; // SDL_GetTicks() at the last UpdateParticles
+
+	int x[capacity], y[capacity];
+	int x_vel[capacity], y_vel[capacity];
+	int life_ms[capacity];
+	Uint32 color[capacity];
 };
 
-struct GameState {
-	static const unsigned max_players = 4;
-	static const unsigned player_count = 4;
-	static const unsigned human_players = 1;
+/* Rendered strings, so the same text in the same font and colors is only
+ * ever rasterized once. It holds a fixed number; when it's full the one
+ * used longest ago makes room. */
+struct TextCache{
+	static const unsigned max_entries = 32;
+	static const unsigned max_text = 32; // longer strings aren't cached
+
+	struct Entry{
+		char text[max_text];
+		TTF_Font *font;
+		SDL_Color fg, bg;
+		SDL_Surface *surface;
+		unsigned last_used;
+	} entry[max_entries];
+
+	unsigned count;
+	unsigned clock; // ticks once per lookup
+};
 
-	PlayerType player_types[player_count];
+/* Which of a seat's keys an InputEvent is about. */
+enum Button{ BUTTON_LEFT, BUTTON_RIGHT, BUTTON_DOWN, BUTTON_ROTATE };
 
-	bool playing;
-	bool paused;
+/* A key going down or coming up, stamped with when the main thread saw
+ * it. The simulation applies it to the first tick at or after that time. */
+struct InputEvent{
+	Uint32 time;
+	unsigned char player;
+	unsigned char button; // a Button
+	bool pressed;
+};
 
-	struct Board{
-		static const unsigned x_offset = 40;
-		static const unsigned y_offset = 40;
-		static const unsigned width_in_pieces = 6;
-		static const unsigned height_in_pieces = 12;
-		static const unsigned piece_width = 30;
-		static const unsigned piece_height = 30;
-		static const unsigned height_in_px = piece_height * height_in_pieces;
-		static const unsigned width_in_px = piece_width * width_in_pieces;
+/* What a key does: which seat's which Button. Looked up by SDLKey, so
+ * any number of seats can have keys without any code per seat. */
+struct KeyBinding{
+	bool bound;
+	unsigned char player;
+	unsigned char button; // a Button
+};
 
-		bool lost, won;
-		Sint32 score;
-		Uint32 last_forced_move;
-		Uint32 last_guided_move; // when a player is holding down
-		int move_delay;
+KeyBinding key_bindings[SDLK_LAST];
 
+/* Keys on their way from the main thread, which has to poll SDL, to the
+ * simulation thread. One pusher and one popper, so two counters are all
+ * the synchronisation it needs; a full queue drops the key. */
+struct InputQueue{
+	static const unsigned capacity = 256;
+
+	InputEvent event[capacity];
+	std::atomic<unsigned> head; // next to pop, only moved by the simulation
+	std::atomic<unsigned> tail; // next to push, only moved by the main thread
+};
+
+/* Everything a frame draws, copied out of the simulation after it steps.
+ * Once published it isn't written again until the renderer has moved on,
+ * so drawing never reads a board halfway through a tick. */
+struct Snapshot{
+	struct Board{
+		Bitboard b;
+		FallInfo fall;
+		unsigned fall_started;
 		int ojamms_pending;
-		Piece *b[width_in_pieces][height_in_pieces];
+		bool lost, won;
+		bool has_couple;
+		Piece couple[2]; // the active couple, if has_couple
+	} board[Match::max_players]; // the first player_count
+
+	bool playing;
+	unsigned now;    // match.now
+	Uint32 taken_at; // SDL_GetTicks() when it was published
+	ParticlePool particles;
+};
+
+/* Three snapshots: the one being drawn, the newest finished one, and the
+ * one being written. The simulation swaps its slot with ready when it
+ * publishes and the renderer swaps its slot with ready when there is
+ * something newer, so neither ever waits and the renderer always gets the
+ * latest. */
+struct SnapshotBuffer{
+	static const unsigned fresh = 4; // on ready: not taken since published
+
+	Snapshot slot[3];
+	std::atomic<unsigned> ready; // slot index, | fresh
+	unsigned writing;            // only touched by the simulation
+	unsigned reading;            // only touched by the renderer
+};
+
+/* Where the main loop is between matches. */
+enum MatchPhase{ MATCH_PLAYING, MATCH_OVER };
 
-	} board[player_count];
+/* The SDL side of a game: the Match it plays, plus everything needed to
+ * draw it, hear it and feed it keys. */
+struct GameState {
+	static const unsigned max_players = Match::max_players;
+
+	unsigned player_count;
+	unsigned human_players; // the first this many seats are HUM
+
+	bool paused;
 
-	Couple *active_couple[player_count];
-	std::vector<Particle> particles;
+	/* Where the boards sit on screen: in rows of columns, each under a
+	 * strip for its incoming garbage, scaled to fit (LayoutBoards). The
+	 * rules half is Match::Board. */
+	struct Layout{
+		static const unsigned width_in_pieces = Match::Board::width_in_pieces;
+		static const unsigned height_in_pieces = Match::Board::height_in_pieces;
+		static const unsigned fall_ms_per_row = 1000/60;
+
+		unsigned columns;
+		unsigned x_offset, y_offset; // the first board's top left
+		unsigned piece_width, piece_height;
+		unsigned width_in_px, height_in_px; // one board's
+		unsigned hud_height;                // the strip over each board
+	} layout;
+
+	/* The simulation's side. Once StartSimulation runs only its thread
+	 * touches these, until StopSimulation joins it. */
+	Match match;
+	bool held[max_players][3];        // LEFT, RIGHT and DOWN keys down
+	bool rotate_pressed[max_players]; // ROTATE presses since the last tick
+	ParticlePool particles;
+	Rng particle_rng;   // cosmetic only, kept apart from the match's streams
+	std::thread simulation;
+	std::atomic<bool> stop;
+
+	/* Between the two */
+	InputQueue input;
+	SnapshotBuffer snapshots;
+
+	/* The renderer's side */
+	const Snapshot *view; // the latest snapshot taken
+	unsigned render_now;  // view->now plus however far into the next tick this frame is
 
 	/* Resources */
 	Mix_Chunk *chain;  // Sound played when a chain happens
 	Mix_Music *bg_mus; // BG Music
 	TTF_Font *font;    // Font
+
+	TextCache text; // belongs with font, so it goes when the font does
+
+	/* What the screen showed as of the last frame, so the next one only
+	 * redraws and presents the parts that changed. */
+	struct Damage{
+		static const unsigned max_rects = 4 * max_players;
+		static const unsigned cells = Match::Board::width_in_pieces * Match::Board::height_in_pieces;
+
+		bool everything; // redraw the whole screen next frame
+		unsigned char shown[max_players][cells]; // 0 if empty, else PieceColor+1
+		bool falling[max_players];               // mid fall animation
+		int pending_shown[max_players];
+		bool lost_shown[max_players];
+		bool won_shown[max_players];
+		SDL_Rect particle_box; // around every particle drawn, w is 0 if none
+
+		unsigned count;
+		SDL_Rect rect[max_rects]; // this frame's, clipped to the screen
+	} damage;
 };
 
 // Forward Declarations //////////////////////////////////
@@ -89,33 +244,53 @@ struct GameState {
 
 // Update -------------------------------
 void UpdateTick(GameState*);
-Couple *GenerateNewCouple(GameState*);
-Direction GetRelationBetweenPieces(Piece *, Piece *);
-void MoveActiveCouple(GameState*, int, Direction);
-void SetAllFalling(GameState *, int);
-void FallPieces(GameState*, int);
-bool CheckForCombos(GameState*, int);
-void BranchSearch(GameState*, int, int, int, PieceColor, std::vector<Piece*> &, std::vector<Piece*>&);
-void UpdateParticles(std::vector<Particle>&);
-void OjammAttack(GameState *, int);
-void CPUTick(GameState*, int);
+void UpdateParticles(ParticlePool&, Uint32);
+void SpawnParticle(ParticlePool&, Uint32, int, int, int, int, int);
+void OnPuyoPopped(void*, int, int, int, PieceColor);
+void OnChain(void*, int, int);
+void RunSimulation(GameState*);
+void StartSimulation(GameState*);
+void StopSimulation(GameState*);
+void PublishSnapshot(GameState*);
+const Snapshot *LatestSnapshot(GameState*);
+void ApplyInput(GameState*, Uint32);
 
 // Render --------------------------------
 void RenderTick(SDL_Surface*, GameState*);
+void LayoutBoards(GameState::Layout&, unsigned, int, int);
+int BoardX(GameState*, int);
+int BoardY(GameState*, int);
+bool ClipMeets(SDL_Surface*, int, int, int, int);
+void FindDamage(SDL_Surface*, GameState*);
+void AddDamage(SDL_Surface*, GameState::Damage&, int, int, int, int);
 void ClearSurfaceTo(SDL_Surface *, Uint32);
 void DrawBoardGrids(SDL_Surface*, GameState*);
 void DrawPuyos(SDL_Surface*, GameState*);
-void DrawParticles(SDL_Surface*, std::vector<Particle>&);
+void DrawPuyo(SDL_Surface*, GameState*, int, int, int, int, PieceColor);
+bool BuildSpriteAtlas(SpriteAtlas&, unsigned, unsigned);
+Uint32 PuyoColor(PieceColor);
+bool BuildBackground(BackgroundLayer&, SDL_Surface*, GameState*);
+void DrawParticles(SDL_Surface*, const ParticlePool&);
 void DrawImpendingDoom(SDL_Surface*, GameState*);
 void DrawLoserBanner(SDL_Surface*, GameState*);
 void DrawWinnerBanner(SDL_Surface*, GameState*);
+SDL_Surface *CachedText(TextCache&, TTF_Font*, const char*, SDL_Color, SDL_Color);
+SDL_Surface *HudText(GameState*, const char*);
+int DrawText(SDL_Surface*, GameState*, const char*, int, int);
+int DrawNumber(SDL_Surface*, GameState*, int, int, int);
+void CleanTextCache(TextCache&);
 
 // GameState ------------------------------
-GameState *InitNewGame();
+GameState *InitNewGame(unsigned long long, unsigned, unsigned);
 void CleanGameState(GameState*);
 
 // Input ----------------------------------
 void HandleInput(GameState *gs, SDL_Event &event);
+void DefaultKeyBindings();
+bool LoadKeyBindings(const char*);
+bool PushInput(InputQueue&, const InputEvent&);
+bool PeekInput(InputQueue&, InputEvent&);
+void PopInput(InputQueue&);
 
 // Entry Point ///////////////////////////////////////////
 //////////////////////////////////////////////////////////
@@ -123,7 +298,35 @@ void HandleInput(GameState *gs, SDL_Event &event);
 int main(int argc, char *argv[])
 {
 	atexit(SDL_Quit);
-	srand(time(NULL));
+
+	/* Pass a seed to replay a match; each following match takes the next.
+	 * A second argument caps frames per second (default 60, 0 for no cap),
+	 * a third sets how many seats play (default 4, up to max_players) and
+	 * a fourth how many of them are human (default 1). */
+	unsigned long long seed = time(NULL);
+	if(argc > 1)
+		seed = strtoull(argv[1], NULL, 10);
+
+	unsigned frame_ms = 1000/60;
+	if(argc > 2){
+		unsigned fps = strtoul(argv[2], NULL, 10);
+		frame_ms = fps ? 1000 / fps : 0;
+	}
+
+	/* Clamped here, the way InitMatch would, so the pools below are sized
+	 * for the seats that actually play. */
+	unsigned players = 4;
+	if(argc > 3)
+		players = strtoul(argv[3], NULL, 10);
+	players = std::max(2u, std::min(players, (unsigned) Match::max_players));
+
+	unsigned humans = 1;
+	if(argc > 4)
+		humans = strtoul(argv[4], NULL, 10);
+
+	/* keys.cfg, if there is one, replaces the default keys. */
+	DefaultKeyBindings();
+	LoadKeyBindings("keys.cfg");
 
 	if(SDL_Init(SDL_INIT_EVERYTHING) == 1){
 		std::cerr << "Error initializing SDL\n";
@@ -139,7 +342,6 @@ int main(int argc, char *argv[])
 	}
 
 	SDL_Event event;
-	Uint32 last_tick = SDL_GetTicks();
 
 	/* Holy fucking sound initialization batman. */
 	int mix_flags = MIX_INIT_MP3;
@@ -171,44 +373,93 @@ int main(int argc, char *argv[])
 		font_on = true;
 	}
 
-	GameState *gs = InitNewGame();
+	board_pool = StartBoardPool(std::min(std::thread::hardware_concurrency(), players));
+	search_table = StartTranspositionTable(search_table_bytes);
+
+	unsigned cores = std::thread::hardware_concurrency();
+	search_pool = StartSearchPool(cores > 3 ? cores - 2 : 1, players);
+
+	GameState *gs = InitNewGame(seed, players, humans);
 	if(gs == NULL){
 		std::cerr << "Error initializing new game.\n";
 		return -1;
 	}
 
-	gameloop:
-	while(gs->playing)
+	BuildSpriteAtlas(puyo_sprites, gs->layout.piece_width, gs->layout.piece_height);
+	BuildBackground(background, screen, gs);
+
+	/* The match runs on its own thread (RunSimulation) and hands over a
+	 * Snapshot after it steps. This one polls SDL, queues keys for it,
+	 * and draws whatever snapshot is newest at most every frame_ms. */
+	static const Uint32 result_ms = 5000; // how long a finished match stays up
+
+	StartSimulation(gs);
+
+	MatchPhase phase = MATCH_PLAYING;
+	Uint32 phase_ends = 0;
+	Uint32 last_frame = SDL_GetTicks() - frame_ms;
+	bool running = true;
+
+	while(running)
 	{
+		/* Once a match is going nothing should touch the heap; build with
+		 * -DPUYO_COUNT_ALLOCATIONS to hold every frame to that. */
+		unsigned long long allocations = AllocationCount();
+		bool new_match = false;
+
 		while(SDL_PollEvent(&event))
 		{
 			if(event.type == SDL_QUIT)
-				return 0;
-			if(event.type == SDL_KEYDOWN)
-			{
-				if(event.key.keysym.sym == SDLK_ESCAPE)
-					return 0;
-
+				running = false;
+			if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
+				running = false;
+			if(event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
 				HandleInput(gs, event);
-			}
 		}
 
-		if(SDL_GetTicks() - last_tick > 1000/60){
-			UpdateTick(gs);
-			last_tick = SDL_GetTicks();
+		gs->view = LatestSnapshot(gs);
+		Uint32 now = SDL_GetTicks();
+
+		/* Between matches: hold the result up for a while, then deal the
+		 * next one, without ever stopping the loop. */
+		if(phase == MATCH_PLAYING && !gs->view->playing){
+			phase = MATCH_OVER;
+			phase_ends = now + result_ms;
+		}
+		else if(phase == MATCH_OVER && (Sint32) (now - phase_ends) >= 0){
+			CleanGameState(gs);
+			gs = InitNewGame(++seed, players, humans);
+			StartSimulation(gs);
+			phase = MATCH_PLAYING;
+			new_match = true;
 		}
 
-		RenderTick(screen, gs);
-		SDL_Flip(screen);
-	}
+		if(now - last_frame >= frame_ms){
+			/* Falling pieces are drawn as far along as the time since the
+			 * snapshot says, not frozen at its tick. */
+			gs->render_now = gs->view->now + std::min(now - gs->view->taken_at, (Uint32) Match::tick_ms);
+
+			RenderTick(screen, gs);
+			SDL_UpdateRects(screen, gs->damage.count, gs->damage.rect);
+			last_frame = now;
+		}
 
-	RenderTick(screen, gs);
-	SDL_Delay(5000);
+		if(!new_match)
+			assert(AllocationCount() == allocations);
+
+		/* Sleep off whatever is left before the next frame. Uncapped,
+		 * still let go of the core for a moment so the simulation gets it. */
+		Sint32 wait = (Sint32) (last_frame + frame_ms) - (Sint32) SDL_GetTicks();
+		if(frame_ms == 0)
+			wait = 1;
+		if(wait > 0)
+			SDL_Delay(wait);
+	}
 
 	CleanGameState(gs);
-	gs = InitNewGame();
-	goto gameloop;
-	
+	StopBoardPool(board_pool);
+	StopSearchPool(search_pool);
+	StopTranspositionTable(search_table);
 
 	if(screen)
 		SDL_FreeSurface(screen);
@@ -226,543 +477,454 @@ void UpdateTick(GameState *gs)
 	if(!gs)
 		return;
 
-
-	/* Keys currently pressed down */
-	Uint8 *keys = SDL_GetKeyState(NULL);
-	if(SDL_GetTicks() - gs->board[0].last_guided_move > gs->board[0].move_delay)
-	{
-		if(keys[SDLK_s]){
-			MoveActiveCouple(gs, 0, DOWN);
-			gs->board[0].last_forced_move = SDL_GetTicks();
-		}
-		if(keys[SDLK_a])
-			MoveActiveCouple(gs, 0, LEFT);
-		if(keys[SDLK_d])
-			MoveActiveCouple(gs, 0, RIGHT);
-
-		gs->board[0].last_guided_move = SDL_GetTicks();
+	MatchInput input;
+	for(unsigned p = 0; p < gs->player_count; p++){
+		input.player[p].left = gs->held[p][BUTTON_LEFT];
+		input.player[p].right = gs->held[p][BUTTON_RIGHT];
+		input.player[p].down = gs->held[p][BUTTON_DOWN];
+		input.player[p].rotate = gs->rotate_pressed[p];
+		gs->rotate_pressed[p] = false;
 	}
 
-	if(SDL_GetTicks() - gs->board[1].last_guided_move > gs->board[1].move_delay && gs->human_players > 1)
-	{
-		if(keys[SDLK_h]){
-			MoveActiveCouple(gs, 1, DOWN);
-			gs->board[1].last_forced_move = SDL_GetTicks();
-		}
-		if(keys[SDLK_g])
-			MoveActiveCouple(gs, 1, LEFT);
-		if(keys[SDLK_j])
-			MoveActiveCouple(gs, 1, RIGHT);
+	StepMatch(&gs->match, input);
+	UpdateParticles(gs->particles, SDL_GetTicks());
+}
 
-		gs->board[1].last_guided_move = SDL_GetTicks();
+void UpdateParticles(ParticlePool &particles, Uint32 now)
+{
+	int elapsed = now - particles.last_update;
+	particles.last_update = now;
+
+	unsigned n = particles.count;
+	for(unsigned i = 0; i < n; i++){
+		particles.x[i] += particles.x_vel[i];
+		particles.y[i] += particles.y_vel[i];
+		particles.life_ms[i] -= elapsed;
 	}
 
-	if(SDL_GetTicks() - gs->board[2].last_guided_move > gs->board[2].move_delay && gs->human_players > 2)
-	{
-		if(keys[SDLK_SEMICOLON]){
-			MoveActiveCouple(gs, 2, DOWN);
-			gs->board[2].last_forced_move = SDL_GetTicks();
+	/* Swap the dead out. The one moved in is checked before moving on. */
+	for(unsigned i = 0; i < n; ){
+		if(particles.life_ms[i] > 0){
+			i++;
+			continue;
 		}
-		if(keys[SDLK_l])
-			MoveActiveCouple(gs, 2, LEFT);
-		if(keys[SDLK_QUOTE])
-			MoveActiveCouple(gs, 2, RIGHT);
 
-		gs->board[2].last_guided_move = SDL_GetTicks();
+		n--;
+		particles.x[i] = particles.x[n];
+		particles.y[i] = particles.y[n];
+		particles.x_vel[i] = particles.x_vel[n];
+		particles.y_vel[i] = particles.y_vel[n];
+		particles.life_ms[i] = particles.life_ms[n];
+		particles.color[i] = particles.color[n];
 	}
+	particles.count = n;
+}
 
-	if(SDL_GetTicks() - gs->board[3].last_guided_move > gs->board[3].move_delay && gs->human_players > 3)
-	{
-		if(keys[SDLK_DOWN]){
-			MoveActiveCouple(gs, 3, DOWN);
-			gs->board[3].last_forced_move = SDL_GetTicks();
-		}
-		if(keys[SDLK_LEFT])
-			MoveActiveCouple(gs, 3, LEFT);
-		if(keys[SDLK_RIGHT])
-			MoveActiveCouple(gs, 3, RIGHT);
+void SpawnParticle(ParticlePool &particles, Uint32 color, int life_ms, int x, int y, int x_vel, int y_vel)
+{
+	if(particles.count >= particles.limit)
+		return;
 
-		gs->board[3].last_guided_move = SDL_GetTicks();
-	}
+	unsigned i = particles.count++;
+	particles.x[i] = x;
+	particles.y[i] = y;
+	particles.x_vel[i] = x_vel;
+	particles.y_vel[i] = y_vel;
+	particles.life_ms[i] = life_ms;
+	particles.color[i] = color;
+}
 
-	int losers = 0;
-	for(unsigned p = 0; p < gs->player_count; p++)
+/* Match hook: every popped puyo throws off a few particles. */
+void OnPuyoPopped(void *user, int player, int x, int y, PieceColor)
+{
+	GameState *gs = (GameState*) user;
+
+	int particle_count = 4;
+	for(unsigned pi = 0; pi < particle_count; pi++)
 	{
-		if(gs->board[p].lost == false && gs->board[p].won == false){
-			if(gs->active_couple[p] == NULL){
-				/* Spawn new random piece for our player. */
-				 gs->active_couple[p] = GenerateNewCouple(gs);
-
-				 Sint16 x1, x2, y1, y2;
-				 x1 = gs->active_couple[p]->p[0]->x;
-				 x2 = gs->active_couple[p]->p[1]->x;
-				 y1 = gs->active_couple[p]->p[0]->y;
-				 y2 = gs->active_couple[p]->p[1]->y;
-
-				 if(gs->board[p].b[x1][y1] != NULL){
-					 gs->board[p].lost = true;
-					 delete gs->active_couple[p]->p[0];
-					 delete gs->active_couple[p]->p[1];
-					 delete gs->active_couple[p];
-				 } else{
-					 gs->board[p].b[x1][y1] = gs->active_couple[p]->p[0];
-					 gs->board[p].b[x2][y2] = gs->active_couple[p]->p[1];
-				 }
-			} else {
-				if(SDL_GetTicks() - gs->board[p].last_forced_move > 500 && gs->board[p].lost == false && gs->board[p].won == false){
-					CPUTick(gs,p);
-					MoveActiveCouple(gs, p, DOWN);
-					gs->board[p].last_forced_move = SDL_GetTicks();
-				}
-
-				FallPieces(gs, p);
-			}
-		}
-		else if(gs->board[p].lost){
-			OjammAttack(gs,p);
-			losers++;
-		}
+		int px = BoardX(gs, player) + (x * gs->layout.piece_width);
+		int py = BoardY(gs, player) + (y * gs->layout.piece_height);
+		int pxvel = RandomBelow(gs->particle_rng, 15)+5 * RandomBelow(gs->particle_rng, 2) * -1;
+		int pyvel = RandomBelow(gs->particle_rng, 15)+5 * RandomBelow(gs->particle_rng, 2) * -1;
+		SpawnParticle(gs->particles, 0xFFFFFFFF, 500, px, py, pxvel, pyvel);
 	}
+}
 
-	if(losers == gs->player_count - 1){
-		for(unsigned p = 0; p < gs->player_count; p++){
-			if(gs->board[p].lost != true){
-				gs->playing = false;
-			}
-		}
-	}
+/* Match hook: one chain sound per popped group. */
+void OnChain(void *user, int, int)
+{
+	GameState *gs = (GameState*) user;
 
-	UpdateParticles(gs->particles);
+	if(mixer_on)
+		Mix_PlayChannel(-1, gs->chain, 0);
 }
 
-Couple *GenerateNewCouple(GameState *gs)
+/* The simulation thread: steps the match a fixed tick_ms at a time,
+ * however the clock goes. Real time piles up in accumulator and is paid
+ * out in whole ticks; after a long stall (a dragged window, a breakpoint)
+ * it gives up catching up past max_catch_up ticks rather than freezing to
+ * replay them. Runs until the match ends or StopSimulation. */
+void RunSimulation(GameState *gs)
 {
-	if(!gs)
-		return NULL;
+	static const unsigned max_catch_up = 5;
+	const Uint32 tick_ms = gs->match.tick_ms;
 
-	if(gs->max_players == 0)
-		return NULL;
+	Uint32 previous = SDL_GetTicks();
+	Uint32 accumulator = 0;
+
+	while(!gs->stop && gs->match.playing){
+		Uint32 now = SDL_GetTicks();
+		accumulator += now - previous;
+		previous = now;
 
-	Couple *c = new Couple();
+		unsigned ticks = 0;
+		while(accumulator >= tick_ms && ticks < max_catch_up){
+			accumulator -= tick_ms;
 
-	for(unsigned i = 0; i < 2; i++){
-		Piece *p = new Piece();
+			/* This tick stands for the moment now - accumulator, so it
+			 * gets every key that had happened by then. */
+			ApplyInput(gs, now - accumulator);
+			UpdateTick(gs);
+			ticks++;
+		}
+		if(accumulator >= tick_ms)
+			accumulator %= tick_ms;
 
-		p->falling = true;
-		p->color = (PieceColor) (rand()%5);
-		p->w = gs->board[0].piece_width;
-		p->h = gs->board[0].piece_height;
-		p->y = 0;
+		if(ticks)
+			PublishSnapshot(gs);
 
-		c->p[i] = p;
+		Sint32 wait = (Sint32) (tick_ms - accumulator) - (Sint32) (SDL_GetTicks() - now);
+		if(wait > 0)
+			SDL_Delay(wait);
 	}
 
-	c->p[0]->x = 2;
-	c->p[1]->x = 3;
+	PublishSnapshot(gs);
+}
 
-	return c;
+void StartSimulation(GameState *gs)
+{
+	gs->stop = false;
+	gs->simulation = std::thread(RunSimulation, gs);
 }
 
-Direction GetRelationBetweenPieces(Piece *p1, Piece *p2)
+/* Safe to call whether or not the thread is running, or already done. */
+void StopSimulation(GameState *gs)
 {
-	if(p1->x < p2->x && p1->y == p2->y)
-		return RIGHT;
-	else if(p1->x > p2->x && p1->y == p2->y)
-		return LEFT;
-	else if(p1->x == p2->x && p1->y > p2->y)
-		return UP;
-	else
-		return DOWN;
+	gs->stop = true;
+	if(gs->simulation.joinable())
+		gs->simulation.join();
 }
 
-void MoveActiveCouple(GameState* gs, int player, Direction dir)
+/* Copies what the renderer needs into the slot the simulation owns, then
+ * trades it for the ready one. */
+void PublishSnapshot(GameState *gs)
 {
-	Couple *active_couple = gs->active_couple[player];
-	if(active_couple == NULL)
-		return;
+	SnapshotBuffer &buffer = gs->snapshots;
+	Snapshot &s = buffer.slot[buffer.writing];
 
-	Piece *p1 = active_couple->p[0];
-	Piece *p2 = active_couple->p[1];
-	
-	if(p1 == NULL || p2 == NULL)
-		return;
+	for(unsigned p = 0; p < gs->player_count; p++){
+		Match::Board &board = gs->match.board[p];
+		Snapshot::Board &to = s.board[p];
+
+		to.b = board.b;
+		to.fall = board.fall;
+		to.fall_started = board.fall_started;
+		to.ojamms_pending = board.ojamms_pending;
+		to.lost = board.lost;
+		to.won = board.won;
+
+		Couple *couple = gs->match.active_couple[p];
+		to.has_couple = couple != NULL;
+		if(couple != NULL){
+			to.couple[0] = *couple->p[0];
+			to.couple[1] = *couple->p[1];
+		}
+	}
 
-	Direction relation = GetRelationBetweenPieces(p1,p2);
-	int x1 = p1->x;
-	int x2 = p2->x;
-	int y1 = p1->y;
-	int y2 = p2->y;
+	s.playing = gs->match.playing;
+	s.now = gs->match.now;
+	s.taken_at = SDL_GetTicks();
+
+	/* Only the live particles are worth copying. */
+	ParticlePool &from = gs->particles;
+	unsigned n = from.count;
+	s.particles.count = n;
+	s.particles.limit = from.limit;
+	s.particles.last_update = from.last_update;
+	memcpy(s.particles.x, from.x, n * sizeof(from.x[0]));
+	memcpy(s.particles.y, from.y, n * sizeof(from.y[0]));
+	memcpy(s.particles.x_vel, from.x_vel, n * sizeof(from.x_vel[0]));
+	memcpy(s.particles.y_vel, from.y_vel, n * sizeof(from.y_vel[0]));
+	memcpy(s.particles.life_ms, from.life_ms, n * sizeof(from.life_ms[0]));
+	memcpy(s.particles.color, from.color, n * sizeof(from.color[0]));
+
+	buffer.writing = buffer.ready.exchange(buffer.writing | buffer.fresh) & ~buffer.fresh;
+}
 
-	if(dir == LEFT){
-		if(p1->x > 0 &&
-		   p2->x > 0){
+/* The newest published snapshot, which stays put until the next call. */
+const Snapshot *LatestSnapshot(GameState *gs)
+{
+	SnapshotBuffer &buffer = gs->snapshots;
+	if(buffer.ready.load() & buffer.fresh)
+		buffer.reading = buffer.ready.exchange(buffer.reading) & ~buffer.fresh;
+	return &buffer.slot[buffer.reading];
+}
 
-			if(relation == LEFT && gs->board[player].b[x2-1][y2] != NULL ){
-				return;
-			}
-			else if( (relation == UP || relation == DOWN) && (gs->board[player].b[x1-1][y1] != NULL ||
-					                    gs->board[player].b[x2-1][y2] != NULL)){
-					return;
-			}
-			else if( relation == RIGHT && gs->board[player].b[x1-1][y1] != NULL){
-				return;
-			}
-			else{
-				p1->x--;
-				p2->x--;
-
-				gs->board[player].b[x1][y1] = NULL;
-				gs->board[player].b[x2][y2] = NULL;
-				gs->board[player].b[x1-1][y1] = p1;
-				gs->board[player].b[x2-1][y2] = p2;
-			}
-		}
-	}
-	else if( dir == RIGHT ) {
-		if((unsigned) p1->x < gs->board[player].width_in_pieces-1  &&
-		   (unsigned) p2->x < gs->board[player].width_in_pieces-1 ){
-			if(relation == RIGHT && gs->board[player].b[x2+1][y2] != NULL ){
-				return;
-			}
-			else if( (relation == UP || relation == DOWN) && (gs->board[player].b[x1+1][y1] != NULL ||
-					                    gs->board[player].b[x2+1][y2] != NULL)){
-					return;
-			}
-			else if( relation == LEFT && gs->board[player].b[x1+1][y1] != NULL){
-				return;
-			} else {
-				p1->x++;
-				p2->x++;
-
-				gs->board[player].b[x1][y1] = NULL;
-				gs->board[player].b[x2][y2] = NULL;
-				gs->board[player].b[x1+1][y1] = p1;
-				gs->board[player].b[x2+1][y2] = p2;
-			}
+/* Takes every queued key that happened by until. Held keys stay held
+ * until they come up; a ROTATE press lasts for the one tick. */
+void ApplyInput(GameState *gs, Uint32 until)
+{
+	InputEvent e;
+	while(PeekInput(gs->input, e) && (Sint32) (e.time - until) <= 0){
+		PopInput(gs->input);
+
+		if(e.button == BUTTON_ROTATE){
+			if(e.pressed)
+				gs->rotate_pressed[e.player] = true;
 		}
+		else
+			gs->held[e.player][e.button] = e.pressed;
 	}
-	else if( dir == DOWN) {
+}
 
-		if(p1->falling == false || p2->falling == false )
-			return;
+// Render ////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
 
-		if((unsigned) p1->y < gs->board[player].height_in_pieces-1 &&
-		   (unsigned) p2->y < gs->board[player].height_in_pieces-1 &&
-		   ((gs->board[player].b[x1][y1+1] == NULL && relation == UP)  ||
-		    (gs->board[player].b[x2][y2+1] == NULL && relation == DOWN)||
-		    (gs->board[player].b[x1][y1+1] == NULL && gs->board[player].b[x2][y2+1] == NULL)))
-		{
-			p1->y++;
-			p2->y++;
 
-			gs->board[player].b[x1][y1] = NULL;
-			gs->board[player].b[x2][y2] = NULL;
-			gs->board[player].b[x1][y1+1] = p1;
-			gs->board[player].b[x2][y2+1] = p2;
-		} else {
-			if(gs->active_couple[player])
-				delete gs->active_couple[player];
+void RenderTick(SDL_Surface *screen, GameState *gs)
+{
+	if(BuildSpriteAtlas(puyo_sprites, gs->layout.piece_width, gs->layout.piece_height))
+		gs->damage.everything = true;
+	if(BuildBackground(background, screen, gs))
+		gs->damage.everything = true;
+
+	FindDamage(screen, gs);
+
+	/* Everything is drawn in every damaged rect, clipped to it, so
+	 * whatever overlaps a change is put back exactly as it was. */
+	for(unsigned i = 0; i < gs->damage.count; i++){
+		SDL_SetClipRect(screen, &gs->damage.rect[i]);
+
+		SDL_Rect from = gs->damage.rect[i];
+		SDL_Rect to = gs->damage.rect[i];
+		SDL_BlitSurface(background.surface, &from, screen, &to);
+		DrawPuyos(screen, gs);
+		DrawParticles(screen, gs->view->particles);
+		DrawImpendingDoom(screen, gs);
+		DrawWinnerBanner(screen, gs);
+		DrawLoserBanner(screen, gs);
+	}
 
-			gs->active_couple[player] = NULL;
+	SDL_SetClipRect(screen, NULL);
+}
 
-			do{
-				SetAllFalling(gs,player);
-				FallPieces(gs,player);
-			} while(CheckForCombos(gs,player));
+/* Works out which parts of the screen no longer match the game: cells
+ * whose contents changed, whole boards while pieces are easing down,
+ * the area the particles cover now and covered last frame, and the
+ * incoming garbage line. A banner coming or going, which can spill across
+ * boards, redraws everything. */
+void FindDamage(SDL_Surface *screen, GameState *gs)
+{
+	GameState::Damage &damage = gs->damage;
+	unsigned height = gs->layout.height_in_pieces;
+	unsigned piece_width = gs->layout.piece_width;
+	unsigned piece_height = gs->layout.piece_height;
 
-			SetAllFalling(gs,player);
-			FallPieces(gs,player);
-			
-			if(gs->board[player].ojamms_pending >= 0){
-				OjammAttack(gs,player);
-			}
-			gs->board[player].last_forced_move = SDL_GetTicks();
+	damage.count = 0;
+
+	for(unsigned p = 0; p < gs->player_count; p++){
+		const Snapshot::Board &board = gs->view->board[p];
+		int bx = BoardX(gs, p);
+		int by = BoardY(gs, p);
+
+		if(board.lost != damage.lost_shown[p] || board.won != damage.won_shown[p]){
+			damage.lost_shown[p] = board.lost;
+			damage.won_shown[p] = board.won;
+			damage.everything = true;
 		}
-	}
-	else if( dir == ROTATE )
-	{
-		/* Second piece always gets rotated around the first piece.
-		 * Right becomes up becomes left becomes down becomes right. */
-		if(relation == RIGHT){
-			if(p1->y != 0){
-				p2->x = x1;
-				p2->y = y2-1;
-				gs->board[player].b[x1][y2-1] = p2;
-				gs->board[player].b[x2][y2] = NULL;
-			}
+
+		if(board.ojamms_pending != damage.pending_shown[p]){
+			damage.pending_shown[p] = board.ojamms_pending;
+			AddDamage(screen, damage, 0, by - gs->layout.hud_height, screen->w, gs->layout.hud_height);
 		}
-		else if(relation == UP){
-			if(p1->x > 0 &&
-			   gs->board[player].b[x1-1][y1] == NULL){
-				p2->x = x1-1;
-				p2->y = y1;
-				gs->board[player].b[x1-1][y1] = p2;
-				gs->board[player].b[x2][y2] = NULL;
+
+		unsigned char now[GameState::Damage::cells];
+		memset(now, 0, sizeof(now));
+
+		int fallen_px = (gs->render_now - board.fall_started) * piece_height / gs->layout.fall_ms_per_row;
+		bool falling = false;
+
+		for(unsigned c = 0; c <= OJAMM; c++){
+			for(BoardMask m = board.b.color[c]; m; m &= m - 1){
+				int cell = LowestBit(m);
+				now[cell] = c + 1;
+				if(board.fall.drop[cell] * (int) piece_height > fallen_px)
+					falling = true;
 			}
 		}
-		else if(relation == LEFT){
-			if(p1->y < gs->board[player].height_in_pieces-1 &&
-			   gs->board[player].b[x1][y1+1] == NULL)
-			{
-				p2->x = x1;
-				p2->y = y1+1;
-				gs->board[player].b[x1][y1+1] = p2;
-				gs->board[player].b[x2][y2] = NULL;
-			}
+
+		if(board.has_couple){
+			for(unsigned i = 0; i < 2; i++)
+				now[board.couple[i].x * height + board.couple[i].y] = board.couple[i].color + 1;
 		}
-		else if(relation == DOWN){
-			if(p1->x < gs->board[player].width_in_pieces - 1 &&
-			   gs->board[player].b[x1+1][y1] == NULL)
-			{
-				p2->x = x1+1;
-				p2->y = y1;
-				gs->board[player].b[x1+1][y1] = p2;
-				gs->board[player].b[x2][y2] = NULL;
+
+		unsigned changed = 0;
+		for(unsigned cell = 0; cell < GameState::Damage::cells; cell++)
+			changed += now[cell] != damage.shown[p][cell];
+
+		/* Past a handful of cells one rect for the board is cheaper. The
+		 * board's outline is drawn one pixel past its size. */
+		if(falling || damage.falling[p] || changed > 8)
+			AddDamage(screen, damage, bx, by, gs->layout.width_in_px + 1, gs->layout.height_in_px + 1);
+		else if(changed){
+			for(unsigned cell = 0; cell < GameState::Damage::cells; cell++){
+				if(now[cell] != damage.shown[p][cell])
+					AddDamage(screen, damage, bx + (cell / height) * piece_width, by + (cell % height) * piece_height, piece_width, piece_height);
 			}
 		}
+
+		damage.falling[p] = falling;
+		memcpy(damage.shown[p], now, sizeof(now));
 	}
-}
 
-void SetAllFalling(GameState *gs, int player)
-{
-	for(unsigned x = 0; x < gs->board[player].width_in_pieces; x++){
-		for(unsigned y = 0; y < gs->board[player].height_in_pieces; y++){
-			Piece *p = gs->board[player].b[x][y];
-			if(p != NULL)
-				p->falling = true;
+	/* Particles are drawn 3px either side of where they are. */
+	const ParticlePool &particles = gs->view->particles;
+	SDL_Rect box = {0, 0, 0, 0};
+	if(particles.count){
+		int x1 = particles.x[0], x2 = particles.x[0];
+		int y1 = particles.y[0], y2 = particles.y[0];
+		for(unsigned i = 1; i < particles.count; i++){
+			x1 = std::min(x1, particles.x[i]);
+			x2 = std::max(x2, particles.x[i]);
+			y1 = std::min(y1, particles.y[i]);
+			y2 = std::max(y2, particles.y[i]);
 		}
-	}
-}
 
-void FallPieces(GameState *gs, int player)
-{
-	SetAllFalling(gs,player);
-	for(unsigned x = 0; x < gs->board[player].width_in_pieces; x++){
-		for(unsigned y = 0; y < gs->board[player].height_in_pieces; y++){
-			Piece *p = gs->board[player].b[x][y];
-			if(p != NULL &&
-			   p->falling)
-			{
-				if(gs->active_couple[player] != NULL)
-				{
-					if((gs->active_couple[player]->p[0]->x == x &&
-					    gs->active_couple[player]->p[0]->y == y ) ||
-					   (gs->active_couple[player]->p[1]->x == x &&
-					    gs->active_couple[player]->p[1]->y == y))
-						continue;
-				}
-
-				if(p->y != gs->board[player].height_in_pieces-1 &&
-				   gs->board[player].b[x][y+1] == NULL){
-					p->y++;
-					gs->board[player].b[x][y] = NULL;
-					gs->board[player].b[x][y+1] = p;
-				} else {
-					p->falling = false;
-				}
-			}
+		x1 = std::max(x1 - 3, 0);
+		y1 = std::max(y1 - 3, 0);
+		x2 = std::min(x2 + 4, screen->w);
+		y2 = std::min(y2 + 4, screen->h);
+		if(x1 < x2 && y1 < y2){
+			SDL_Rect around = {x1, y1, x2 - x1, y2 - y1};
+			box = around;
+			AddDamage(screen, damage, box.x, box.y, box.w, box.h);
 		}
 	}
-}
-
-
-int getnext(int val, int max){
-	if(val+1 == max)
-		return 0;
-	else
-		return val+1;
-}
 
-void OjammAttack(GameState *gs, int target)
-{
-	if(gs->board[target].lost){
-		gs->board[getnext(target,gs->player_count)].ojamms_pending += gs->board[target].ojamms_pending;
-		gs->board[target].ojamms_pending = 0;
-		return;
-	}
+	if(damage.particle_box.w)
+		AddDamage(screen, damage, damage.particle_box.x, damage.particle_box.y, damage.particle_box.w, damage.particle_box.h);
+	damage.particle_box = box;
 
-	if(gs->board[target].ojamms_pending > gs->board[target].width_in_pieces)
-		gs->board[target].ojamms_pending = gs->board[target].width_in_pieces;
-
-	int offsetx = rand()%5;
-	for(unsigned o = 0; o < gs->board[target].ojamms_pending; o++){
-		Piece *ojamm = new Piece();
-		ojamm->color = OJAMM;
-		ojamm->falling = true;
-		ojamm->x = (offsetx + o) % gs->board[target].width_in_pieces;
-		ojamm->y = 0;
-		ojamm->w = gs->board[target].piece_width;
-		ojamm->h = gs->board[target].piece_height;
-
-		gs->board[target].b[ojamm->x][0] = ojamm;
-		FallPieces(gs,target);		
+	if(damage.everything){
+		damage.count = 0;
+		damage.everything = false;
+		AddDamage(screen, damage, 0, 0, screen->w, screen->h);
 	}
-
-	gs->board[target].ojamms_pending = 0;
-	FallPieces(gs,target);
 }
 
-bool CheckForCombos(GameState *gs, int player)
+/* Tiles players boards over the screen in whichever number of columns
+ * gives the biggest pieces. Margins and the strip over each board grow
+ * with the pieces: four boards come out in a row of 30px pieces across
+ * 800px, sixty-four in four rows of 7px ones. */
+void LayoutBoards(GameState::Layout &layout, unsigned players, int screen_w, int screen_h)
 {
-	bool found = false;
-
-	for(unsigned x = 0; x < gs->board[player].width_in_pieces; x++){
-		for(unsigned y = 0; y < gs->board[player].height_in_pieces; y++){
-			Piece *piece = gs->board[player].b[x][y];
-			if(piece == NULL)
-				continue;
-
-			std::vector<Piece*> involved;
-			std::vector<Piece*> touched;
-
-			BranchSearch(gs, player, x, y, piece->color, involved, touched);
-
-			int ojamms_amongst_them = 0;
-			if(involved.size() >= 4) // C-C-C-C-COMBO!
-			{
-				for(unsigned o_search = 0; o_search < involved.size(); o_search++)
-				{
-					if(involved[o_search]->color == OJAMM)
-						ojamms_amongst_them++;
-				}
-
-				if(involved.size() - ojamms_amongst_them < 4)
-					goto no_chain;
-
-				for(unsigned i = 0; i < involved.size(); i++){
-					if(involved[i]){
-						int x1 = involved[i]->x;
-						int y1 = involved[i]->y;
-						
-						/* Generate particles. */
-						int particle_count = 4;
-						for(unsigned pi = 0; pi < particle_count; pi++)
-						{
-							int px = gs->board[player].x_offset + (x1 * gs->board[player].piece_width) + (player * gs->board[player].width_in_px);
-							int py = gs->board[player].y_offset + (y1 * gs->board[player].piece_height);
-							int pxvel = rand()%15+5 * (rand()%2) * -1;
-							int pyvel = rand()%15+5 * (rand()%2) * -1;
-							Particle pc = {0xFFFFFFFF, SDL_GetTicks(), 500, px, py, pxvel, pyvel};
-							gs->particles.push_back(pc);
-						}
-
-						delete involved[i];
-						gs->board[player].b[x1][y1] = NULL;
-					}
-				}
-
-				int ojamms = 0;
-				switch(involved.size()){
-				case 4:
-					ojamms = 1;
-					break;
-				case 5:
-					ojamms = 3;
-					break;
-				case 6:
-					ojamms = 5;
-					break;
-				case 7:
-					ojamms = 6;
-					break;
-				default:
-					ojamms = 1;
-					break;
-				}
-
-				/* OJAMMS, AHOY! */
-				if(gs->board[player].ojamms_pending - ojamms <= 0)
-					gs->board[player].ojamms_pending = 0;
-				else
-					gs->board[player].ojamms_pending -= ojamms;
-					
-				gs->board[getnext(player,gs->player_count)].ojamms_pending += ojamms;
-
-				if(mixer_on)
-					Mix_PlayChannel(-1, gs->chain, 0);
-				
-				found = true;
-			}
-
-			no_chain:;
+	int w = layout.width_in_pieces;
+	int h = layout.height_in_pieces;
+
+	int best = 0;
+	unsigned best_columns = players;
+	for(unsigned columns = 1; columns <= players; columns++){
+		int rows = (players + columns - 1) / columns;
+
+		/* Across: the boards, and a piece plus 10px either side. Down: a
+		 * strip of a piece plus 10px over each row, and 10px under all. */
+		int across = (screen_w - 20) / (int) (columns * w + 2);
+		int down = (screen_h - 10 - 10 * rows) / (rows * (h + 1));
+		int piece = std::min(across, down);
+		if(piece > best){
+			best = piece;
+			best_columns = columns;
 		}
 	}
-
-	return found;
+	if(best < 1)
+		best = 1;
+
+	layout.columns = best_columns;
+	layout.piece_width = best;
+	layout.piece_height = best;
+	layout.width_in_px = best * w;
+	layout.height_in_px = best * h;
+	layout.hud_height = best + 10;
+	layout.x_offset = (screen_w - (int) (best_columns * layout.width_in_px)) / 2;
+	layout.y_offset = layout.hud_height;
 }
 
-void BranchSearch(GameState *gs, int player, int x, int y, PieceColor color, std::vector<Piece*> &involved, std::vector<Piece*> &touched)
+/* The screen position of board p's top left. */
+int BoardX(GameState *gs, int p)
 {
+	return gs->layout.x_offset + (p % gs->layout.columns) * gs->layout.width_in_px;
+}
 
-	if(x<0 || y<0 || y >= gs->board[player].height_in_pieces || x >= gs->board[player].width_in_pieces)
-		return;
+int BoardY(GameState *gs, int p)
+{
+	return gs->layout.y_offset + (p / gs->layout.columns) * (gs->layout.height_in_px + gs->layout.hud_height);
+}
 
-	Piece *p = gs->board[player].b[x][y];
-	if(p == NULL)
-		return;
+/* Whether a rect overlaps the screen's clip rect, i.e. whether drawing in
+ * it right now could show. */
+bool ClipMeets(SDL_Surface *screen, int x, int y, int w, int h)
+{
+	SDL_Rect &clip = screen->clip_rect;
+	return x < clip.x + clip.w && x + w > clip.x && y < clip.y + clip.h && y + h > clip.y;
+}
 
-	if(std::find(touched.begin(), touched.end(), p) != touched.end())
+/* Queues a damaged rect, clipped to the screen. Running out of room just
+ * means redrawing everything. */
+void AddDamage(SDL_Surface *screen, GameState::Damage &damage, int x, int y, int w, int h)
+{
+	int x2 = std::min(x + w, screen->w);
+	int y2 = std::min(y + h, screen->h);
+	x = std::max(x, 0);
+	y = std::max(y, 0);
+	if(x >= x2 || y >= y2)
 		return;
-	else
-		touched.push_back(p);
 
-	if(p->color == color) {
-		involved.push_back(p);
-	}
-	else if(p->color == OJAMM){
-		involved.push_back(p);
+	if(damage.count == damage.max_rects){
+		damage.everything = true;
 		return;
 	}
-	else{
-		return;
-	}
-
-	BranchSearch(gs,player,x,y-1,color,involved,touched);
-	BranchSearch(gs,player,x-1,y,color,involved,touched);
-	BranchSearch(gs,player,x+1,y,color,involved,touched);
-	BranchSearch(gs,player,x,y+1,color,involved,touched);
 
-	return;
+	SDL_Rect r = {x, y, x2 - x, y2 - y};
+	damage.rect[damage.count++] = r;
 }
 
-void UpdateParticles(std::vector<Particle> &particles)
+/* Composites the background for this screen and layout, unless that's
+ * what it already holds. Returns whether it had to redraw. */
+bool BuildBackground(BackgroundLayer &layer, SDL_Surface *screen, GameState *gs)
 {
-	for(unsigned i = 0; i < particles.size(); i++)
-	{
-		if(SDL_GetTicks() - particles[i].created_at > particles[i].time_to_live)
-		{
-			particles.erase(particles.begin()+i);
-		} else{
-			particles[i].x += particles[i].x_vel;
-			particles[i].y += particles[i].y_vel;
-		}
-	}
-}
+	static const Uint32 bg_color = 0x666666;
 
-void CPUTick(GameState *gs, int player)
-{
-	if( gs->player_types[player] == CPU )
-	{
-		Direction rnd_dir = (Direction) (rand()%5);
-		MoveActiveCouple(gs,player,rnd_dir);
-	}
-}
+	if(layer.surface && layer.screen_w == screen->w && layer.screen_h == screen->h
+		&& layer.player_count == gs->player_count && layer.columns == gs->layout.columns
+		&& layer.board_w == gs->layout.width_in_px && layer.board_h == gs->layout.height_in_px)
+		return false;
 
-// Render ////////////////////////////////////////////////
-//////////////////////////////////////////////////////////
+	if(layer.surface)
+		SDL_FreeSurface(layer.surface);
 
+	SDL_PixelFormat *f = screen->format;
+	layer.surface = SDL_CreateRGBSurface(SDL_SWSURFACE, screen->w, screen->h, f->BitsPerPixel, f->Rmask, f->Gmask, f->Bmask, f->Amask);
 
-void RenderTick(SDL_Surface *screen, GameState *gs)
-{
-	static const Uint32 bg_color = 0x666666;
+	ClearSurfaceTo(layer.surface, bg_color);
+	DrawBoardGrids(layer.surface, gs);
 
-	ClearSurfaceTo(screen, bg_color);
-	DrawBoardGrids(screen, gs);
-	DrawPuyos(screen, gs);
-	DrawParticles(screen, gs->particles);
-	DrawImpendingDoom(screen, gs);
-	DrawWinnerBanner(screen, gs);
-	DrawLoserBanner(screen, gs);
+	layer.screen_w = screen->w;
+	layer.screen_h = screen->h;
+	layer.player_count = gs->player_count;
+	layer.columns = gs->layout.columns;
+	layer.board_w = gs->layout.width_in_px;
+	layer.board_h = gs->layout.height_in_px;
+	return true;
 }
 
 void ClearSurfaceTo(SDL_Surface *surface, Uint32 color)
@@ -774,78 +936,122 @@ void ClearSurfaceTo(SDL_Surface *surface, Uint32 color)
 
 void DrawBoardGrids(SDL_Surface *screen, GameState *gs)
 {
-	for(unsigned p = 0; p < gs->max_players; p++)
+	for(unsigned p = 0; p < gs->player_count; p++)
 	{
-	    Sint16 x1 = gs->board[p].x_offset + (gs->board[p].width_in_px * p);
-	    Sint16 y1 = gs->board[p].y_offset;
-	    Sint16 x2 = x1 + gs->board[p].width_in_px;
-	    Sint16 y2 = y1 + gs->board[p].height_in_px;
-
-		if(p >= gs->player_count){
-			roundedBoxColor(screen, x1, y1, x2, y2, 2, 0x000000AA);
-			roundedRectangleColor(screen, x1, y1, x2, y2, 5, 0x000000FF);
-		} else {
-			roundedBoxColor(screen, x1, y1, x2, y2, 2, 0x000000AA);
-			roundedRectangleColor(screen, x1, y1, x2, y2, 5, 0x000000FF);
-		}
+	    Sint16 x1 = BoardX(gs, p);
+	    Sint16 y1 = BoardY(gs, p);
+	    Sint16 x2 = x1 + gs->layout.width_in_px;
+	    Sint16 y2 = y1 + gs->layout.height_in_px;
+
+		roundedBoxColor(screen, x1, y1, x2, y2, 2, 0x000000AA);
+		roundedRectangleColor(screen, x1, y1, x2, y2, 5, 0x000000FF);
 	}
 }
 
 void DrawPuyos(SDL_Surface *screen, GameState *gs)
 {
 	for(unsigned p = 0; p < gs->player_count; p++){
-		Sint16 x_offset = gs->board[p].x_offset;
-		Sint16 y_offset = gs->board[p].y_offset;
-		Sint16 width_in_px = gs->board[p].width_in_px;
-		Sint16 piece_width = gs->board[p].piece_width;
-		Sint16 piece_height = gs->board[p].piece_height;
-
-		for(unsigned x = 0; x < gs->board[p].width_in_pieces; x++){
-			for(unsigned y = 0; y < gs->board[p].height_in_pieces; y++){
-				if(gs->board[p].b[x][y] != NULL){
-					Piece *piece = gs->board[p].b[x][y];
-					Sint16 x = x_offset + (piece->x * piece_width)  + (p * width_in_px);
-					Sint16 y = y_offset + (piece->y * piece_height);
-					Sint16 r = (piece_width + piece_height) / 4;
-
-					Uint32 color = 0x000000FF;
-					switch(piece->color)
-					{
-					case BLUE:
-						color = 0x0000FFFF;
-						break;
-					case ORANGE:
-						color = 0xFF9900FF;
-						break;
-					case GREEN:
-						color = 0x00FF00FF;
-						break;
-					case PURPLE:
-						color = 0x9900FFFF;
-						break;
-					case YELLOW:
-						color = 0xFFFF00FF;
-						break;
-					case OJAMM:
-						color = 0x333333FF;
-						break;
-					default:
-						break;
-					}
-
-					filledCircleColor(screen, x+r, y+r, r, color);
-					filledCircleColor(screen, x+r-r/2, y+r+r/4, r/4, 0x000000FF);
-					filledCircleColor(screen, x+r+r/2, y+r+r/4, r/4, 0x000000FF);
-				}
+		/* Everything is drawn once per damaged rect; only boards that
+		 * reach into it are worth going through. */
+		if(!ClipMeets(screen, BoardX(gs, p), BoardY(gs, p), gs->layout.width_in_px, gs->layout.height_in_px))
+			continue;
+
+		const Snapshot::Board &board = gs->view->board[p];
+
+		/* Pieces that just settled are drawn lifted by however much of
+		 * their fall hasn't played out yet. */
+		int fallen_px = (gs->render_now - board.fall_started) * gs->layout.piece_height / gs->layout.fall_ms_per_row;
+
+		for(unsigned c = 0; c <= OJAMM; c++){
+			for(BoardMask m = board.b.color[c]; m; m &= m - 1){
+				int cell = LowestBit(m);
+				int lift = board.fall.drop[cell] * gs->layout.piece_height - fallen_px;
+				DrawPuyo(screen, gs, p, cell / gs->layout.height_in_pieces, cell % gs->layout.height_in_pieces, lift > 0 ? lift : 0, (PieceColor) c);
 			}
 		}
+
+		if(board.has_couple){
+			for(unsigned i = 0; i < 2; i++)
+				DrawPuyo(screen, gs, p, board.couple[i].x, board.couple[i].y, 0, board.couple[i].color);
+		}
 	}
 }
 
-void DrawParticles(SDL_Surface *screen, std::vector<Particle> &particles)
+void DrawPuyo(SDL_Surface *screen, GameState *gs, int p, int px, int py, int lift, PieceColor piece_color)
 {
-	for(unsigned i = 0; i < particles.size(); i++){
-		filledCircleColor(screen, particles[i].x, particles[i].y, 3, particles[i].color);
+	Sint16 piece_width = gs->layout.piece_width;
+	Sint16 piece_height = gs->layout.piece_height;
+
+	SDL_Rect sprite = {piece_color * piece_width, 0, piece_width, piece_height};
+	SDL_Rect to = {BoardX(gs, p) + (px * piece_width), BoardY(gs, p) + (py * piece_height) - lift};
+	SDL_BlitSurface(puyo_sprites.surface, &sprite, screen, &to);
+}
+
+Uint32 PuyoColor(PieceColor piece_color)
+{
+	switch(piece_color)
+	{
+	case BLUE:
+		return 0x0000FFFF;
+	case ORANGE:
+		return 0xFF9900FF;
+	case GREEN:
+		return 0x00FF00FF;
+	case PURPLE:
+		return 0x9900FFFF;
+	case YELLOW:
+		return 0xFFFF00FF;
+	case OJAMM:
+		return 0x333333FF;
+	default:
+		return 0x000000FF;
+	}
+}
+
+/* Draws every color of puyo into the atlas at the given piece size, unless
+ * it already holds exactly that. Magenta marks the see-through corners, and
+ * the result is converted to the screen's format so blits are plain
+ * copies. Returns whether it had to redraw. */
+bool BuildSpriteAtlas(SpriteAtlas &atlas, unsigned piece_width, unsigned piece_height)
+{
+	static const Uint32 transparent = 0xFF00FF;
+
+	if(atlas.surface && atlas.piece_width == piece_width && atlas.piece_height == piece_height)
+		return false;
+
+	if(atlas.surface)
+		SDL_FreeSurface(atlas.surface);
+
+	SDL_Surface *drawn = SDL_CreateRGBSurface(SDL_SWSURFACE, piece_width * (OJAMM+1), piece_height, 32, 0xFF0000, 0x00FF00, 0x0000FF, 0);
+	SDL_FillRect(drawn, NULL, transparent);
+
+	Sint16 r = (piece_width + piece_height) / 4;
+	for(unsigned c = 0; c <= OJAMM; c++){
+		Sint16 x = c * piece_width;
+		filledCircleColor(drawn, x+r, r, r, PuyoColor((PieceColor) c));
+		filledCircleColor(drawn, x+r-r/2, r+r/4, r/4, 0x000000FF);
+		filledCircleColor(drawn, x+r+r/2, r+r/4, r/4, 0x000000FF);
+	}
+
+	SDL_SetColorKey(drawn, SDL_SRCCOLORKEY | SDL_RLEACCEL, transparent);
+
+	atlas.surface = SDL_DisplayFormat(drawn);
+	if(atlas.surface)
+		SDL_FreeSurface(drawn);
+	else
+		atlas.surface = drawn;
+
+	atlas.piece_width = piece_width;
+	atlas.piece_height = piece_height;
+	return true;
+}
+
+void DrawParticles(SDL_Surface *screen, const ParticlePool &particles)
+{
+	for(unsigned i = 0; i < particles.count; i++){
+		if(!ClipMeets(screen, particles.x[i] - 3, particles.y[i] - 3, 7, 7))
+			continue;
+		filledCircleColor(screen, particles.x[i], particles.y[i], 3, particles.color[i]);
 	}
 }
 
@@ -853,31 +1059,28 @@ void DrawImpendingDoom(SDL_Surface *screen, GameState *gs)
 {
 	for(unsigned p = 0; p < gs->player_count; p++)
 	{
-		if(gs->board[p].ojamms_pending >0 ){
-			Sint16 x_offset = gs->board[p].x_offset;
-			Sint16 y_offset = gs->board[p].y_offset;
-			Sint16 width_in_px = gs->board[p].width_in_px;
-			Sint16 piece_width = gs->board[p].piece_width;
-			Sint16 piece_height = gs->board[p].piece_height;
+		/* The text can run on past the board's own width, so anything
+		 * in its strip's row counts. */
+		int hud_y = BoardY(gs, p) - gs->layout.hud_height;
+		if(!ClipMeets(screen, 0, hud_y, screen->w, gs->layout.hud_height))
+			continue;
+
+		if(gs->view->board[p].ojamms_pending >0 ){
+			Sint16 piece_width = gs->layout.piece_width;
+			Sint16 piece_height = gs->layout.piece_height;
 		
-			int x = x_offset + 15 + (p * width_in_px);
-			int y = 5;
+			int x = BoardX(gs, p) + piece_width / 2;
+			int y = hud_y + gs->layout.hud_height / 8;
 			int r = (piece_width + piece_height) / 4;
 
-			Uint32 color = 0x333333FF;
-			filledCircleColor(screen, x+r, y+r, r, color);
-			filledCircleColor(screen, x+r-r/2, y+r+r/4, r/4, 0x000000FF);
-			filledCircleColor(screen, x+r+r/2, y+r+r/4, r/4, 0x000000FF);
+			SDL_Rect sprite = {OJAMM * piece_width, 0, piece_width, piece_height};
+			SDL_Rect to = {x, y};
+			SDL_BlitSurface(puyo_sprites.surface, &sprite, screen, &to);
 
 			if(font_on){
-				std::stringstream s;
-				s << " incoming: " << gs->board[p].ojamms_pending << "   ";
-				SDL_Color fg = {0xFF,0xFF,0xFF};
-				SDL_Color bg = {0x33,0x33,0x33};
-				SDL_Surface *fontsurf = TTF_RenderText(gs->font, s.str().c_str(),fg, bg);
-				SDL_Rect fontblitrect = {x+r*4, y+2, 50, 50};
-				SDL_BlitSurface(fontsurf, NULL, screen, &fontblitrect);
-				SDL_FreeSurface(fontsurf);
+				int tx = x + r*4;
+				tx += DrawText(screen, gs, " incoming: ", tx, y+2);
+				DrawNumber(screen, gs, gs->view->board[p].ojamms_pending, tx, y+2);
 			}
 		}
 	}
@@ -887,27 +1090,17 @@ void DrawLoserBanner(SDL_Surface *screen, GameState *gs)
 {
 	for(unsigned p = 0; p < gs->player_count; p++)
 	{
-		if(gs->board[p].lost){
-			Sint16 x_offset = gs->board[p].x_offset;
-			Sint16 y_offset = gs->board[p].y_offset;
-			Sint16 width_in_px = gs->board[p].width_in_px;
-			Sint16 height_in_px = gs->board[p].height_in_px;
-			Sint16 piece_width = gs->board[p].piece_width;
-			Sint16 piece_height = gs->board[p].piece_height;
-
-			int bh = height_in_px / 5;
-			int bw = width_in_px;
-			int bx = x_offset + (p * width_in_px);
-			int by = height_in_px / 2;
-
-			std::string loser =  "        You lose.     ";
-
-			SDL_Color fg = {0xFF,0xFF,0xFF};
-			SDL_Color bg = {0x33,0x33,0x33};
-			SDL_Surface *fontsurf = TTF_RenderText(gs->font, loser.c_str(), fg, bg);
-			SDL_Rect fontblitrect = {bx + 20, bh + 10, bw, bh};
-			SDL_BlitSurface(fontsurf, NULL, screen, &fontblitrect);
-			SDL_FreeSurface(fontsurf);
+		if(gs->view->board[p].lost){
+			Sint16 height_in_px = gs->layout.height_in_px;
+			Sint16 piece_width = gs->layout.piece_width;
+
+			int bx = BoardX(gs, p);
+			int by = BoardY(gs, p);
+			if(!ClipMeets(screen, 0, by, screen->w, height_in_px))
+				continue;
+
+			if(font_on)
+				DrawText(screen, gs, "        You lose.     ", bx + piece_width * 2 / 3, by + height_in_px / 5 + 10 - gs->layout.hud_height);
 		}
 	}
 }
@@ -917,64 +1110,157 @@ void DrawWinnerBanner(SDL_Surface *screen, GameState *gs)
 {
 	for(unsigned p = 0; p < gs->player_count; p++)
 	{
-		if(gs->board[p].won){
-			Sint16 x_offset = gs->board[p].x_offset;
-			Sint16 y_offset = gs->board[p].y_offset;
-			Sint16 width_in_px = gs->board[p].width_in_px;
-			Sint16 height_in_px = gs->board[p].height_in_px;
-			Sint16 piece_width = gs->board[p].piece_width;
-			Sint16 piece_height = gs->board[p].piece_height;
-
-			int bh = height_in_px / 5;
-			int bw = width_in_px;
-			int bx = x_offset + (p * width_in_px);
-			int by = height_in_px / 2;
-
-			std::string loser =  "        You win!     ";
-
-			SDL_Color fg = {0xFF,0xFF,0xFF};
-			SDL_Color bg = {0x33,0x33,0x33};
-			SDL_Surface *fontsurf = TTF_RenderText(gs->font, loser.c_str(), fg, bg);
-			SDL_Rect fontblitrect = {bx + 20, bh + 10, bw, bh};
-			SDL_BlitSurface(fontsurf, NULL, screen, &fontblitrect);
-			SDL_FreeSurface(fontsurf);
+		if(gs->view->board[p].won){
+			Sint16 height_in_px = gs->layout.height_in_px;
+			Sint16 piece_width = gs->layout.piece_width;
+
+			int bx = BoardX(gs, p);
+			int by = BoardY(gs, p);
+			if(!ClipMeets(screen, 0, by, screen->w, height_in_px))
+				continue;
+
+			if(font_on)
+				DrawText(screen, gs, "        You win!     ", bx + piece_width * 2 / 3, by + height_in_px / 5 + 10 - gs->layout.hud_height);
 		}
 	}
 }
 
+/* The rendered surface for text, from the cache if it's there. Returns
+ * NULL if it can't be rendered. */
+SDL_Surface *CachedText(TextCache &cache, TTF_Font *font, const char *text, SDL_Color fg, SDL_Color bg)
+{
+	cache.clock++;
+
+	unsigned oldest = 0;
+	for(unsigned i = 0; i < cache.count; i++){
+		TextCache::Entry &e = cache.entry[i];
+		if(e.font == font && strcmp(e.text, text) == 0
+			&& e.fg.r == fg.r && e.fg.g == fg.g && e.fg.b == fg.b
+			&& e.bg.r == bg.r && e.bg.g == bg.g && e.bg.b == bg.b){
+			e.last_used = cache.clock;
+			return e.surface;
+		}
+
+		if(e.last_used < cache.entry[oldest].last_used)
+			oldest = i;
+	}
+
+	if(font == NULL || strlen(text) >= cache.max_text)
+		return NULL;
+
+	SDL_Surface *surface = TTF_RenderText(font, text, fg, bg);
+	if(surface == NULL)
+		return NULL;
+
+	unsigned slot = oldest;
+	if(cache.count < cache.max_entries)
+		slot = cache.count++;
+	else
+		SDL_FreeSurface(cache.entry[slot].surface);
+
+	TextCache::Entry &e = cache.entry[slot];
+	strcpy(e.text, text);
+	e.font = font;
+	e.fg = fg;
+	e.bg = bg;
+	e.surface = surface;
+	e.last_used = cache.clock;
+	return surface;
+}
+
+/* HUD text is all white on dark grey. */
+SDL_Surface *HudText(GameState *gs, const char *text)
+{
+	SDL_Color fg = {0xFF,0xFF,0xFF};
+	SDL_Color bg = {0x33,0x33,0x33};
+	return CachedText(gs->text, gs->font, text, fg, bg);
+}
+
+/* Returns how wide the text came out. */
+int DrawText(SDL_Surface *screen, GameState *gs, const char *text, int x, int y)
+{
+	SDL_Surface *surface = HudText(gs, text);
+	if(surface == NULL)
+		return 0;
+
+	SDL_Rect to = {x, y};
+	SDL_BlitSurface(surface, NULL, screen, &to);
+	return surface->w;
+}
+
+/* A counter, put together a digit at a time from the cached glyphs so a
+ * changing number never goes back to the font. */
+int DrawNumber(SDL_Surface *screen, GameState *gs, int value, int x, int y)
+{
+	char digits[16];
+	snprintf(digits, sizeof(digits), "%d", value);
+
+	int w = 0;
+	for(unsigned i = 0; digits[i]; i++){
+		char glyph[2] = { digits[i], 0 };
+		w += DrawText(screen, gs, glyph, x + w, y);
+	}
+	return w;
+}
+
+void CleanTextCache(TextCache &cache)
+{
+	for(unsigned i = 0; i < cache.count; i++)
+		SDL_FreeSurface(cache.entry[i].surface);
+	cache.count = 0;
+}
+
 // Gamestate /////////////////////////////////////////////
 //////////////////////////////////////////////////////////
 
-GameState *InitNewGame()
+/* players is clamped to what a Match holds and humans to players. */
+GameState *InitNewGame(unsigned long long seed, unsigned players, unsigned humans)
 {
 	GameState *newgame = new GameState();
-	newgame->playing = true;
 	newgame->paused = false;
 
-	for(unsigned p = 0; p < newgame->player_count; p++){
-		for(unsigned x = 0; x < newgame->board[p].width_in_pieces; x++){
-			for(unsigned y = 0; y < newgame->board[p].height_in_pieces; y++){
-				newgame->board[p].b[x][y] = NULL;
-			}
-		}
+	std::cout << "Match seed: " << seed << std::endl;
+	InitMatch(&newgame->match, seed, players);
+	newgame->player_count = newgame->match.player_count;
+	newgame->human_players = std::min(humans, newgame->player_count);
+	LayoutBoards(newgame->layout, newgame->player_count, SCR_W, SCR_H);
+
+	SeedRng(newgame->particle_rng, seed);
+	newgame->match.hooks.user = newgame;
+	newgame->match.hooks.on_pop = OnPuyoPopped;
+	newgame->match.hooks.on_chain = OnChain;
+	newgame->match.pool = board_pool;
+	newgame->match.table = search_table;
+	newgame->match.search = search_pool;
 
-		newgame->board[p].lost = false;
-		newgame->board[p].won = false;
-		newgame->board[p].score = 0;
-		newgame->board[p].ojamms_pending = 0;
-		newgame->active_couple[p] = NULL;
-		newgame->board[p].move_delay = 125;
-		newgame->board[p].last_forced_move = SDL_GetTicks();
-		newgame->board[p].last_guided_move = SDL_GetTicks();
+	for(unsigned p = 0; p < newgame->player_count; p++){
+		newgame->rotate_pressed[p] = false;
+		for(unsigned b = 0; b < 3; b++)
+			newgame->held[p][b] = false;
 	}
 
+	newgame->damage.everything = true;
+	newgame->particles.count = 0;
+	newgame->particles.limit = ParticlePool::capacity;
+	newgame->particles.last_update = SDL_GetTicks();
+
 	if(font_on){
-		newgame->font = TTF_OpenFont("eartm.ttf", 24);
+		/* Sized to the strip over a board: 24pt for four boards. */
+		newgame->font = TTF_OpenFont("eartm.ttf", std::max(8u, newgame->layout.hud_height * 3 / 5));
 
 		if(newgame->font == NULL)
 		{
 			font_on = false;
 			std::cerr << "Could not load eartm.ttf\n";
+		} else {
+			/* Render everything the HUD can show up front, so nothing
+			 * reaches the font mid-match. */
+			static const char *hud[] = {
+				" incoming: ", "        You lose.     ", "        You win!     ",
+				"0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+			};
+			for(unsigned i = 0; i < sizeof(hud) / sizeof(hud[0]); i++)
+				HudText(newgame, hud[i]);
 		}
 	}
 
@@ -995,14 +1281,26 @@ GameState *InitNewGame()
 		}
 	}
 
-	/* Todo: select screen */
-	newgame->player_types[0] = HUM;
-	newgame->player_types[1] = CPU;
-	newgame->player_types[2] = CPU;
-	newgame->player_types[3] = CPU;
+	/* Todo: select screen. CPU seats think with MCTS in the background
+	 * on search_pool, for up to a quarter second a move from when the
+	 * couple spawns. The tick only ever reads what they have so far, so
+	 * however hard they think, neither it nor a frame waits on them. */
+	for(unsigned p = 0; p < newgame->player_count; p++){
+		newgame->match.player_types[p] = p < newgame->human_players ? HUM : CPU;
+		newgame->match.board[p].ai.mode = AI_MCTS;
+		newgame->match.board[p].ai.background = true;
+		newgame->match.board[p].ai.playouts = 4096;
+		newgame->match.board[p].ai.budget_us = 250000;
+	}
 
-	// newgame->player_types[2] = CPU2;
-	// newgame->player_types[3] = CPU3;
+	/* Something to draw before the simulation has stepped. */
+	newgame->input.head = 0;
+	newgame->input.tail = 0;
+	newgame->snapshots.writing = 0;
+	newgame->snapshots.ready = 1;
+	newgame->snapshots.reading = 2;
+	PublishSnapshot(newgame);
+	newgame->view = LatestSnapshot(newgame);
 
 	return newgame;
 }
@@ -1012,19 +1310,23 @@ GameState *InitNewGame()
 void CleanGameState(GameState *gs)
 {
 	if(gs){
+		StopSimulation(gs);
+
+		/* Calls off any search still running, which records its move, so
+		 * it goes first for the stats to be whole. */
+		CleanMatch(&gs->match);
+
 		for(unsigned p = 0; p < gs->player_count; p++){
-//			if(gs->active_couple[p]){
-//				delete gs->active_couple[p];
-//			}
-
-			for(unsigned x = 0; x < gs->board[p].width_in_pieces; x++){
-				for(unsigned y = 0; y < gs->board[p].height_in_pieces; y++){
-					if(gs->board[p].b[x][y])
-						delete gs->board[p].b[x][y];
-				}
-			}
+			AIStats &t = gs->match.board[p].thought;
+			if(t.moves == 0)
+				continue;
+			std::cout << "Seat " << p << " thought " << t.think_us / t.moves << "us a move at "
+			          << (t.think_us ? t.nodes * 1000000 / t.think_us : 0) << " nodes/sec, "
+			          << t.deadline_misses << " of " << t.moves << " moves out of time" << std::endl;
 		}
 
+		CleanTextCache(gs->text);
+
 		if(font_on){
 			if(gs->font){
 				TTF_CloseFont(gs->font);
@@ -1048,49 +1350,121 @@ void CleanGameState(GameState *gs)
 //////////////////////////////////////////////////////////
 
 
+/* Stamps a human seat's key going down or up and queues it for the
+ * simulation. */
 void HandleInput(GameState *gs, SDL_Event &event)
 {
-	/* Player One Controls: asdw */
-	if(gs->human_players > 0){
-		switch(event.key.keysym.sym){
-		case SDLK_w:
-			MoveActiveCouple(gs, 0, ROTATE);
-			break;
-		default:
-			break;
+	SDLKey key = event.key.keysym.sym;
+	if(key >= SDLK_LAST)
+		return;
+
+	KeyBinding &binding = key_bindings[key];
+	if(!binding.bound || binding.player >= gs->human_players)
+		return;
+
+	InputEvent e;
+	e.time = SDL_GetTicks();
+	e.player = binding.player;
+	e.button = binding.button;
+	e.pressed = event.type == SDL_KEYDOWN;
+	PushInput(gs->input, e);
+}
+
+/* Player One: asdw, Two: ghjy, Three: l;'p, Four: the arrow keys. Left,
+ * right, down and rotate, in the order of Button. */
+void DefaultKeyBindings()
+{
+	static const SDLKey keys[4][4] = {
+		{ SDLK_a,    SDLK_d,     SDLK_s,         SDLK_w },
+		{ SDLK_g,    SDLK_j,     SDLK_h,         SDLK_y },
+		{ SDLK_l,    SDLK_QUOTE, SDLK_SEMICOLON, SDLK_p },
+		{ SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN,      SDLK_UP },
+	};
+
+	memset(key_bindings, 0, sizeof(key_bindings));
+	for(unsigned p = 0; p < 4; p++){
+		for(unsigned b = 0; b < 4; b++){
+			KeyBinding &binding = key_bindings[keys[p][b]];
+			binding.bound = true;
+			binding.player = p;
+			binding.button = b;
 		}
 	}
+}
 
-	/* Player Two Controls: ghjy */
-	if(gs->human_players > 1){
-		switch(event.key.keysym.sym){
-		case SDLK_y:
-			MoveActiveCouple(gs, 1, ROTATE);
-			break;
-		default:
-			break;
+/* Replaces the key bindings with a file's, one per line: a seat counted
+ * from 1, then left, right, down or rotate, then the key as SDL names it
+ * ("1 left a", "5 rotate right ctrl"). Lines starting with # are skipped.
+ * Returns false, leaving the bindings alone, if the file can't be read. */
+bool LoadKeyBindings(const char *path)
+{
+	static const char *button_names[4] = { "left", "right", "down", "rotate" };
+
+	FILE *file = fopen(path, "r");
+	if(file == NULL)
+		return false;
+
+	memset(key_bindings, 0, sizeof(key_bindings));
+
+	char line[128];
+	while(fgets(line, sizeof(line), file)){
+		unsigned seat;
+		char button_name[16];
+		char key_name[64];
+		if(line[0] == '#' || sscanf(line, "%u %15s %63[^\r\n]", &seat, button_name, key_name) != 3)
+			continue;
+
+		int button = -1;
+		for(unsigned b = 0; b < 4; b++){
+			if(strcmp(button_name, button_names[b]) == 0)
+				button = b;
 		}
-	}
 
-	/* Player Three Controls: l;'p */
-	if(gs->human_players > 2){
-		switch(event.key.keysym.sym){
-		case SDLK_p:
-			MoveActiveCouple(gs, 2, ROTATE);
-			break;
-		default:
-			break;
+		int key = -1;
+		for(int k = 1; k < SDLK_LAST && key < 0; k++){
+			if(strcmp(key_name, SDL_GetKeyName((SDLKey) k)) == 0)
+				key = k;
 		}
-	}
 
-	/* Player Three Controls: arrow_keys */
-	if(gs->human_players > 3){
-		switch(event.key.keysym.sym){
-		case SDLK_UP:
-			MoveActiveCouple(gs, 3, ROTATE);
-			break;
-		default:
-			break;
+		if(seat < 1 || seat > GameState::max_players || button < 0 || key < 0){
+			std::cerr << path << ": can't make sense of " << line;
+			continue;
 		}
+
+		key_bindings[key].bound = true;
+		key_bindings[key].player = seat - 1;
+		key_bindings[key].button = button;
 	}
-}
\ No newline at end of file
+
+	fclose(file);
+	return true;
+}
+
+/* Main thread only. Returns false, dropping the key, if the queue is full. */
+bool PushInput(InputQueue &queue, const InputEvent &e)
+{
+	unsigned tail = queue.tail.load(std::memory_order_relaxed);
+	if(tail - queue.head.load(std::memory_order_acquire) == queue.capacity)
+		return false;
+
+	queue.event[tail % queue.capacity] = e;
+	queue.tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+/* Simulation thread only: the oldest queued key, left in the queue. */
+bool PeekInput(InputQueue &queue, InputEvent &e)
+{
+	unsigned head = queue.head.load(std::memory_order_relaxed);
+	if(head == queue.tail.load(std::memory_order_acquire))
+		return false;
+
+	e = queue.event[head % queue.capacity];
+	return true;
+}
+
+/* Simulation thread only, after a successful PeekInput. */
+void PopInput(InputQueue &queue)
+{
+	queue.head.store(queue.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
@@ -0,0 +1,1174 @@
+#include <cstddef>
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "PuyoAI.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const int board_w = MatchEngine::width;
+static const int board_h = MatchEngine::height;
+static const int spawn_x = MatchEngine::spawn_x;
+static const BoardMask spawn_cells = MatchEngine::CellMask(spawn_x, 0) | MatchEngine::CellMask(spawn_x + 1, 0);
+
+/* A board the search has reached, and the first move that led to it. */
+struct AINode{
+	Bitboard b;
+	int pending;            // garbage still queued, less what chains offset
+	unsigned long long key; // PositionKey of b and pending
+	int value;              // reward collected on the way here
+	int score;              // value plus EvaluateBoard, what the beam is ranked by
+	Placement first;
+};
+
+/* One played-out chain: the board as it stood the moment the couple landed,
+ * and how it ended up. Two cache lines. Every field is an atomic word and
+ * seq is a sequence lock: odd while a writer is filling the entry in, so a
+ * reader that sees it change knows it read a torn entry and walks away.
+ * Writers never wait on each other either; one that finds the entry taken
+ * just doesn't store. */
+struct alignas(64) ChainEntry{
+	std::atomic<unsigned long long> seq;
+	std::atomic<unsigned long long> key;  // hash of the board before it popped
+	std::atomic<unsigned long long> data; // chain, ojamms, generation and check; 0 if empty
+	std::atomic<unsigned long long> hash; // of the settled board
+	std::atomic<unsigned long long> mask[(OJAMM+1) * 2];
+};
+
+/* A power of two of ChainEntry, in buckets of two. Each search bumps
+ * generation, so whatever the older searches left is first to go. */
+struct TranspositionTable{
+	ChainEntry *entry;
+	unsigned long long index_mask; // entry count - 1, with the bucket bit clear
+	std::atomic<unsigned> generation;
+
+	alignas(64) std::atomic<unsigned long long> probes;
+	std::atomic<unsigned long long> hits;
+	std::atomic<unsigned long long> occupied_misses;
+	std::atomic<unsigned long long> collisions;
+	std::atomic<unsigned long long> stores;
+	std::atomic<unsigned long long> replaced;
+};
+
+/* Neither search looks further than the couples a seat can see; MCTS only
+ * plays past them in its rollouts. So a Monte Carlo tree never has more
+ * than a full tree of placements that deep, and the arena it lives in is
+ * made that big up front. */
+static const unsigned tree_depth = 1 + Match::preview_count;
+
+static constexpr unsigned TreeSize(unsigned depth)
+{
+	return depth == 0 ? 1 : 1 + PlacementList::max_placements * TreeSize(depth - 1);
+}
+
+static const unsigned max_tree_nodes = TreeSize(tree_depth);
+
+/* What a search starts from, copied out of the Match so it can run on any
+ * thread while the seat's couple goes on moving. */
+struct SearchRoot{
+	Bitboard b;
+	int pending;
+	PieceColor couples[tree_depth][2];
+	Placement fallback; // where the couple stood, for want of an answer
+};
+
+/* How a search went: its answer, how much it looked at and whether it got
+ * through everything before its deadline. */
+struct ThinkResult{
+	Placement best;
+	unsigned long long nodes;
+	bool finished;
+};
+
+/* A node of the tree: a placement of the couple its depth is for. visits
+ * goes up as a playout passes on its way down and value only once it comes
+ * back, so a playout still out counts as a loss. That virtual loss steers
+ * the other threads down other branches meanwhile. */
+struct TreeNode{
+	enum State{ UNEXPANDED, EXPANDING, EXPANDED };
+
+	Placement at;
+	unsigned first_child;
+	unsigned short child_count;
+	std::atomic<unsigned char> state;
+	std::atomic<unsigned> visits;
+	std::atomic<unsigned long long> value; // sum of rewards, in 1/reward_one
+};
+
+/* One seat's search, for as long as it's thinking. Everything it needs is
+ * copied in, so helpers never touch the Match. A seat thinking in the tick
+ * runs playouts alongside the helpers; one thinking in the background
+ * leaves the search to them and just reads the answer so far, for MCTS off
+ * the tree and for the beam from the last level it got through. */
+struct SearchSlot{
+	std::atomic<bool> taken;      // a seat is using it
+	std::atomic<bool> open;       // helpers may join in
+	std::atomic<unsigned> inside; // helpers in it right now
+	std::atomic<bool> releasing;  // the seat is done with it; the last helper out frees it
+	std::atomic<bool> stop;       // the seat has played its move, wind down
+
+	AIMode mode;
+	SearchRoot root;
+	AIConfig config;
+	unsigned limit; // playouts
+	Clock::time_point started;
+	Clock::time_point deadline;
+	TranspositionTable *table;
+	unsigned generation;
+	unsigned long long seed;
+
+	std::atomic<unsigned> playouts; // started so far
+	std::atomic<unsigned> done;     // come back so far
+	std::atomic<unsigned> batches;  // handed to helpers, to seed them apart
+	TreeNode *node;
+	std::atomic<unsigned> node_count;
+
+	std::atomic<bool> beam_taken;  // a helper is running the beam
+	std::atomic<int> beam_answer;  // PackPlacement of the best so far, -1 for none yet
+	std::atomic<unsigned long long> beam_nodes;
+	std::atomic<bool> beam_finished;
+	std::atomic<bool> beam_done;   // the helper has come back
+};
+
+/* Helper threads shared by every CPU seat. Helpers go round the open
+ * searches a batch at a time, so seats thinking at once split them evenly
+ * whatever thread each seat is on, and none gets threads of its own. */
+struct SearchPool{
+	std::vector<std::thread> helpers;
+	std::mutex lock;
+	std::condition_variable wake; // a search opened, or stopping
+	bool stopping;
+
+	std::atomic<unsigned> open_count;
+	std::atomic<unsigned> turn; // next slot a helper looks at
+
+	unsigned slot_count;
+	SearchSlot *slot;
+};
+
+// Forward Declarations //////////////////////////////////
+//////////////////////////////////////////////////////////
+
+static void ReadRoot(Match *, int, SearchRoot &);
+static void KeepBest(AINode *, unsigned &, unsigned, const AINode &);
+static void RunBeam(const SearchRoot &, const AIConfig &, Clock::time_point, TranspositionTable *, SearchSlot *, ThinkResult &);
+static void ThinkNow(Match *, int, ThinkResult &);
+static void RecordThought(Match::Board &, const ThinkResult &, Clock::duration);
+static int PackPlacement(const Placement &);
+static Placement UnpackPlacement(int);
+static int DropReward(const DropResult &);
+static bool PlayDrop(TranspositionTable *, unsigned, const Bitboard &, const Placement &, PieceColor, PieceColor, DropResult &);
+static unsigned BoardCheck(const Bitboard &);
+static bool ProbeChain(TranspositionTable *, unsigned long long, unsigned, DropResult &);
+static void StoreChain(TranspositionTable *, unsigned long long, unsigned, unsigned, const DropResult &);
+static void OpenSearch(SearchSlot &, Match *, int);
+static bool TreeAnswer(SearchSlot &, Placement &);
+static bool RunPlayout(SearchSlot &, Rng &);
+static void ExpandNode(SearchSlot &, TreeNode &, const Bitboard &, unsigned);
+static bool Rollout(SearchSlot &, Bitboard &, unsigned, int &, Rng &);
+static bool ReadAnswer(SearchSlot &, Placement &);
+static bool DoneThinking(SearchSlot &);
+static void FinishThinking(Match *, int);
+static SearchSlot *MakeSlots(unsigned);
+static SearchSlot *TakeSlot(SearchPool *);
+static void ShareSlot(SearchPool *, SearchSlot &);
+static void CloseSlot(SearchPool *, SearchSlot &);
+static void LeaveSlot(SearchSlot &);
+static void ReleaseSlot(SearchSlot &);
+static void RunSearchHelper(SearchPool *);
+static void Steer(Couple *, const Placement &, PlayerInput &);
+
+// Search ////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* How promising a settled board looks: same colors touching is good, tall
+ * columns are bad, and anything in the spawn cells is a lost game. */
+int EvaluateBoard(const Bitboard &b)
+{
+	if(b.occupied & spawn_cells)
+		return -1000000;
+
+	int score = 0;
+	for(unsigned c = 0; c < OJAMM; c++)
+		score += 4 * CountAdjacentPairs(b.color[c]);
+
+	for(int x = 0; x < board_w; x++){
+		int h = ColumnHeight(b, x);
+		score -= h * h / 4;
+
+		if((x == spawn_x || x == spawn_x + 1) && h > board_h - 4)
+			score -= 200;
+	}
+
+	return score;
+}
+
+static void ReadRoot(Match *match, int player, SearchRoot &root)
+{
+	Match::Board &board = match->board[player];
+	Couple *couple = match->active_couple[player];
+
+	root.b = board.b;
+	root.pending = board.ojamms_pending;
+	for(unsigned d = 0; d < tree_depth; d++){
+		root.couples[d][0] = d == 0 ? couple->p[0]->color : board.next[d-1][0];
+		root.couples[d][1] = d == 0 ? couple->p[1]->color : board.next[d-1][1];
+	}
+	root.fallback.x = couple->p[0]->x;
+	root.fallback.orientation = couple->orientation;
+}
+
+/* Insert n into the best-first list, which holds at most width nodes. A
+ * board already on the list by another path is kept only once, with the
+ * better score. */
+static void KeepBest(AINode *list, unsigned &count, unsigned width, const AINode &n)
+{
+	for(unsigned j = 0; j < count; j++){
+		if(list[j].key != n.key)
+			continue;
+		if(list[j].score >= n.score)
+			return;
+
+		for(count--; j < count; j++)
+			list[j] = list[j+1];
+		break;
+	}
+
+	if(count == width && list[count-1].score >= n.score)
+		return;
+
+	unsigned i = count < width ? count++ : count - 1;
+	while(i > 0 && list[i-1].score < n.score){
+		list[i] = list[i-1];
+		i--;
+	}
+	list[i] = n;
+}
+
+Placement FindBestPlacement(Match *match, int player)
+{
+	SearchRoot root;
+	ReadRoot(match, player, root);
+
+	const AIConfig &ai = match->board[player].ai;
+	ThinkResult result;
+	RunBeam(root, ai, Clock::now() + std::chrono::microseconds(ai.budget_us), match->table, NULL, result);
+	return result.best;
+}
+
+/* The beam search. In the background, job gets the best first move after
+ * every level it completes, and the search gives up once job is told to
+ * stop. */
+static void RunBeam(const SearchRoot &root, const AIConfig &ai, Clock::time_point deadline, TranspositionTable *table, SearchSlot *job, ThinkResult &result)
+{
+	unsigned width = ai.beam_width;
+	if(width < 1)
+		width = 1;
+	if(width > max_beam_width)
+		width = max_beam_width;
+
+	unsigned depth = ai.depth;
+	if(depth < 1)
+		depth = 1;
+	if(depth > tree_depth)
+		depth = tree_depth;
+
+	unsigned generation = table ? ++table->generation : 0;
+
+	static thread_local AINode beams[2][max_beam_width];
+	AINode *current = beams[0];
+	AINode *next = beams[1];
+	unsigned current_count = 1;
+
+	current[0].b = root.b;
+	current[0].pending = root.pending;
+	current[0].key = PositionKey(root.b, root.pending);
+	current[0].value = 0;
+	current[0].score = 0;
+	current[0].first = root.fallback;
+
+	result.nodes = 0;
+	result.finished = true;
+
+	for(unsigned d = 0; d < depth; d++){
+		PieceColor c0 = root.couples[d][0];
+		PieceColor c1 = root.couples[d][1];
+		unsigned next_count = 0;
+		bool out_of_time = false;
+
+		for(unsigned n = 0; n < current_count && !out_of_time; n++){
+			PlacementList placements;
+			ListPlacements(current[n].b, c0, c1, placements);
+
+			for(unsigned i = 0; i < placements.count; i++){
+				DropResult drop;
+				if(!PlayDrop(table, generation, current[n].b, placements.placement[i], c0, c1, drop))
+					continue;
+
+				AINode child;
+				child.b = drop.b;
+				child.pending = current[n].pending > drop.ojamms ? current[n].pending - drop.ojamms : 0;
+				child.key = PositionKey(child.b, child.pending);
+				child.value = current[n].value + DropReward(drop);
+				child.score = child.value + EvaluateBoard(child.b);
+				child.first = d == 0 ? placements.placement[i] : current[n].first;
+				KeepBest(next, next_count, width, child);
+				result.nodes++;
+			}
+
+			if(ai.budget_us && Clock::now() > deadline)
+				out_of_time = true;
+			if(job && job->stop.load(std::memory_order_relaxed))
+				out_of_time = true;
+		}
+
+		if(out_of_time)
+			result.finished = false;
+
+		/* A half-searched level would favour whichever nodes happened to
+		 * be expanded first, so past the first level fall back to the
+		 * last complete one. */
+		if(next_count == 0 || (out_of_time && d > 0))
+			break;
+
+		AINode *swap = current;
+		current = next;
+		next = swap;
+		current_count = next_count;
+
+		if(job){
+			job->beam_nodes.store(result.nodes, std::memory_order_relaxed);
+			job->beam_answer.store(PackPlacement(current[0].first), std::memory_order_release);
+		}
+
+		if(out_of_time)
+			break;
+	}
+
+	result.best = current[0].first;
+}
+
+/* Thinks the seat's move through right here, with the pool's helpers if
+ * it's MCTS and there's a pool. */
+static void ThinkNow(Match *match, int player, ThinkResult &result)
+{
+	Match::Board &board = match->board[player];
+	SearchPool *pool = match->search;
+
+	/* Trees only live in a pool's slots, so MCTS falls back to the beam
+	 * without one, or if no slot is free, which only happens if more
+	 * seats think at once than the pool was made for. */
+	SearchSlot *slot = NULL;
+	if(board.ai.mode == AI_MCTS && pool)
+		slot = TakeSlot(pool);
+
+	if(slot == NULL){
+		SearchRoot root;
+		ReadRoot(match, player, root);
+		RunBeam(root, board.ai, Clock::now() + std::chrono::microseconds(board.ai.budget_us), match->table, NULL, result);
+		return;
+	}
+
+	SearchSlot &s = *slot;
+	OpenSearch(s, match, player);
+	if(pool)
+		ShareSlot(pool, s);
+
+	Rng rng;
+	SeedRng(rng, s.seed);
+	while(RunPlayout(s, rng))
+		;
+
+	/* Helpers can't get in once it's shut and are a playout at most from
+	 * leaving; the tree is only read once they have. */
+	if(pool){
+		CloseSlot(pool, s);
+		while(s.inside)
+			std::this_thread::yield();
+	}
+
+	result.best = s.root.fallback;
+	TreeAnswer(s, result.best);
+	result.nodes = s.done;
+	result.finished = s.done >= s.limit;
+
+	if(pool)
+		s.taken = false;
+}
+
+static void RecordThought(Match::Board &board, const ThinkResult &result, Clock::duration took)
+{
+	board.thought.moves++;
+	board.thought.think_us += std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+	board.thought.nodes += result.nodes;
+	if(!result.finished)
+		board.thought.deadline_misses++;
+}
+
+/* A Placement in one int, for handing across threads. */
+static int PackPlacement(const Placement &at)
+{
+	return at.x << 2 | at.orientation;
+}
+
+static Placement UnpackPlacement(int packed)
+{
+	Placement at = { packed >> 2, (Direction) (packed & 3) };
+	return at;
+}
+
+/* What a drop is worth to the seat making it, before what it leaves. */
+static int DropReward(const DropResult &drop)
+{
+	return 10 * drop.ojamms + 5 * drop.chain * drop.chain;
+}
+
+/* SimulateDrop, but a chain that's been played out before, by this search
+ * or any other, is read back from table instead. Most drops pop nothing,
+ * and finding that out is cheaper than a trip to the table, so only chains
+ * go there. Leaves drop.groups unset. */
+static bool PlayDrop(TranspositionTable *table, unsigned generation, const Bitboard &b, const Placement &at, PieceColor c0, PieceColor c1, DropResult &drop)
+{
+	if(table == NULL)
+		return SimulateDrop(b, at, c0, c1, drop);
+
+	drop.b = b;
+	if(!DropCouple(drop.b, at, c0, c1))
+		return false;
+
+	BoardMask dirty = drop.b.occupied & ~b.occupied;
+	GroupList popped;
+	if(FindPoppingGroups(drop.b, popped, dirty) == 0){
+		drop.chain = 0;
+		drop.ojamms = 0;
+		return true;
+	}
+
+	unsigned long long key = drop.b.hash;
+	unsigned check = BoardCheck(drop.b);
+	if(ProbeChain(table, key, check, drop))
+		return true;
+
+	ResolveChain(drop, dirty);
+	StoreChain(table, key, check, generation, drop);
+	return true;
+}
+
+// Transposition Table ///////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* An entry's data word: chain in bits 0-7, ojamms in 8-23, generation in
+ * 24-39, the board's check in 40-62, and bit 63 set once it's used. */
+static const unsigned long long entry_used = 1ull << 63;
+static const unsigned check_bits = 23;
+
+static unsigned long long PackChain(int chain, int ojamms, unsigned generation, unsigned check)
+{
+	return entry_used | (unsigned long long) check << 40 | (unsigned long long) (generation & 0xffff) << 24
+	     | (unsigned long long) (ojamms & 0xffff) << 8 | (unsigned) chain;
+}
+
+static int EntryChain(unsigned long long data) { return data & 0xff; }
+static int EntryOjamms(unsigned long long data) { return (data >> 8) & 0xffff; }
+static unsigned EntryGeneration(unsigned long long data) { return (data >> 24) & 0xffff; }
+static unsigned EntryCheck(unsigned long long data) { return (data >> 40) & ((1u << check_bits) - 1); }
+
+/* A second fingerprint of a board, made from its masks rather than the
+ * Zobrist keys, so two boards whose keys collide almost never share it
+ * as well. A probe whose key matches but whose check doesn't has found a
+ * real collision. */
+static unsigned BoardCheck(const Bitboard &b)
+{
+	unsigned long long h = 0;
+	for(unsigned c = 0; c <= OJAMM; c++){
+		h = (h ^ (unsigned long long) b.color[c]) * 0x9E3779B97F4A7C15ULL;
+		h = (h ^ (unsigned long long) (b.color[c] >> 64)) * 0x9E3779B97F4A7C15ULL;
+	}
+	return h >> (64 - check_bits);
+}
+
+/* A table of at most bytes, and never less than one bucket. Allocates, so
+ * make it before a match starts. */
+TranspositionTable *StartTranspositionTable(std::size_t bytes)
+{
+	std::size_t count = 2;
+	while(count * 2 * sizeof(ChainEntry) <= bytes)
+		count *= 2;
+
+	TranspositionTable *table = new TranspositionTable();
+	table->entry = new ChainEntry[count];
+	table->index_mask = (count - 1) & ~1ull;
+	table->generation = 0;
+
+	for(std::size_t i = 0; i < count; i++){
+		table->entry[i].seq.store(0, std::memory_order_relaxed);
+		table->entry[i].key.store(0, std::memory_order_relaxed);
+		table->entry[i].data.store(0, std::memory_order_relaxed);
+	}
+
+	table->probes = 0;
+	table->hits = 0;
+	table->occupied_misses = 0;
+	table->collisions = 0;
+	table->stores = 0;
+	table->replaced = 0;
+	return table;
+}
+
+void StopTranspositionTable(TranspositionTable *table)
+{
+	if(table == NULL)
+		return;
+
+	delete[] table->entry;
+	delete table;
+}
+
+TableStats GetTableStats(const TranspositionTable *table)
+{
+	TableStats stats = { 0, 0, 0, 0, 0, 0 };
+	if(table){
+		stats.probes = table->probes.load(std::memory_order_relaxed);
+		stats.hits = table->hits.load(std::memory_order_relaxed);
+		stats.occupied_misses = table->occupied_misses.load(std::memory_order_relaxed);
+		stats.collisions = table->collisions.load(std::memory_order_relaxed);
+		stats.stores = table->stores.load(std::memory_order_relaxed);
+		stats.replaced = table->replaced.load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+/* Fills in drop from key's entry if there is a whole one for the same
+ * board, going by check. */
+static bool ProbeChain(TranspositionTable *table, unsigned long long key, unsigned check, DropResult &drop)
+{
+	table->probes.fetch_add(1, std::memory_order_relaxed);
+
+	ChainEntry *bucket = &table->entry[key & table->index_mask];
+	bool crowded = false;
+
+	for(unsigned i = 0; i < 2; i++){
+		ChainEntry &e = bucket[i];
+
+		unsigned long long seq = e.seq.load(std::memory_order_acquire);
+		if(seq & 1){
+			crowded = true;
+			continue;
+		}
+		if(e.key.load(std::memory_order_relaxed) != key){
+			crowded |= e.data.load(std::memory_order_relaxed) != 0;
+			continue;
+		}
+
+		unsigned long long data = e.data.load(std::memory_order_relaxed);
+		Bitboard b;
+		b.occupied = 0;
+		for(unsigned c = 0; c <= OJAMM; c++){
+			unsigned long long lo = e.mask[c*2].load(std::memory_order_relaxed);
+			unsigned long long hi = e.mask[c*2+1].load(std::memory_order_relaxed);
+			b.color[c] = (BoardMask) hi << 64 | lo;
+			b.occupied |= b.color[c];
+		}
+		b.hash = e.hash.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(e.seq.load(std::memory_order_relaxed) != seq || data == 0){
+			crowded = true;
+			continue;
+		}
+		/* Another board under the same key; ours may still be in the
+		 * other slot. */
+		if(EntryCheck(data) != check){
+			table->collisions.fetch_add(1, std::memory_order_relaxed);
+			crowded = true;
+			continue;
+		}
+
+		drop.b = b;
+		drop.chain = EntryChain(data);
+		drop.ojamms = EntryOjamms(data);
+		table->hits.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	if(crowded)
+		table->occupied_misses.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+/* Which of a bucket's two entries makes way: an empty one, then the one
+ * left longest ago, then the shorter chain, being the cheaper to play out
+ * again. */
+static void StoreChain(TranspositionTable *table, unsigned long long key, unsigned check, unsigned generation, const DropResult &drop)
+{
+	ChainEntry *bucket = &table->entry[key & table->index_mask];
+
+	unsigned long long data[2];
+	for(unsigned i = 0; i < 2; i++)
+		data[i] = bucket[i].data.load(std::memory_order_relaxed);
+
+	unsigned victim;
+	if(data[0] == 0 || data[1] == 0)
+		victim = data[0] == 0 ? 0 : 1;
+	else{
+		unsigned age0 = (generation - EntryGeneration(data[0])) & 0xffff;
+		unsigned age1 = (generation - EntryGeneration(data[1])) & 0xffff;
+		if(age0 != age1)
+			victim = age0 > age1 ? 0 : 1;
+		else
+			victim = EntryChain(data[0]) <= EntryChain(data[1]) ? 0 : 1;
+	}
+
+	ChainEntry &e = bucket[victim];
+	unsigned long long seq = e.seq.load(std::memory_order_relaxed);
+	if((seq & 1) || !e.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+		return;
+	std::atomic_thread_fence(std::memory_order_release);
+
+	e.key.store(key, std::memory_order_relaxed);
+	e.data.store(PackChain(drop.chain, drop.ojamms, generation, check), std::memory_order_relaxed);
+	e.hash.store(drop.b.hash, std::memory_order_relaxed);
+	for(unsigned c = 0; c <= OJAMM; c++){
+		e.mask[c*2].store((unsigned long long) drop.b.color[c], std::memory_order_relaxed);
+		e.mask[c*2+1].store((unsigned long long) (drop.b.color[c] >> 64), std::memory_order_relaxed);
+	}
+	e.seq.store(seq + 2, std::memory_order_release);
+
+	table->stores.fetch_add(1, std::memory_order_relaxed);
+	if(data[victim] != 0)
+		table->replaced.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Monte Carlo ///////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* Rewards are squashed into [0, 1] before they're summed, so one huge
+ * chain can't drown out every other playout; reward_scale is the reward
+ * that counts for three quarters. A lost game is 0. */
+static const double reward_scale = 200.0;
+static const unsigned long long reward_one = 1 << 16;
+static const double explore = 0.7;
+static const unsigned helper_batch = 4; // playouts a helper runs per visit to a search
+
+static unsigned long long SquashReward(int reward)
+{
+	double r = 0.5 + 0.5 * reward / (std::fabs((double) reward) + reward_scale);
+	return (unsigned long long) (r * reward_one);
+}
+
+/* Sets s up to think about player's couple, from now until budget_us is
+ * up, with nothing searched yet. */
+static void OpenSearch(SearchSlot &s, Match *match, int player)
+{
+	Match::Board &board = match->board[player];
+
+	ReadRoot(match, player, s.root);
+	s.mode = board.ai.mode;
+	s.config = board.ai;
+	s.limit = board.ai.playouts ? board.ai.playouts : 1;
+	s.started = Clock::now();
+	s.deadline = s.started + std::chrono::microseconds(board.ai.budget_us);
+	s.table = match->table;
+	s.generation = s.table ? ++s.table->generation : 0;
+	s.seed = PositionKey(board.b, board.ojamms_pending) ^ ((unsigned long long) match->now << 20) ^ player;
+	s.stop = false;
+	s.releasing = false;
+
+	s.playouts = 0;
+	s.done = 0;
+	s.batches = 0;
+
+	TreeNode &root = s.node[0];
+	root.state.store(TreeNode::UNEXPANDED, std::memory_order_relaxed);
+	root.child_count = 0;
+	root.visits.store(0, std::memory_order_relaxed);
+	root.value.store(0, std::memory_order_relaxed);
+	s.node_count.store(1, std::memory_order_relaxed);
+
+	s.beam_taken = false;
+	s.beam_answer = -1;
+	s.beam_nodes = 0;
+	s.beam_finished = false;
+	s.beam_done = false;
+}
+
+/* The root placement tried most so far, if any has been. */
+static bool TreeAnswer(SearchSlot &s, Placement &best)
+{
+	TreeNode &root = s.node[0];
+	if(root.state.load(std::memory_order_acquire) != TreeNode::EXPANDED)
+		return false;
+
+	unsigned most = 0;
+	unsigned long long most_value = 0;
+	for(unsigned i = 0; i < root.child_count; i++){
+		TreeNode &child = s.node[root.first_child + i];
+		unsigned visits = child.visits.load(std::memory_order_relaxed);
+		unsigned long long value = child.value.load(std::memory_order_relaxed);
+		if(visits > most || (visits == most && visits && value > most_value)){
+			most = visits;
+			most_value = value;
+			best = child.at;
+		}
+	}
+
+	return most > 0;
+}
+
+/* Walks down by UCB1 to a node nobody has expanded, expands it and plays
+ * on from there to the end of the rollout, then hands the reward back up
+ * the path. Returns false once the search is out of playouts or time, or
+ * told to stop. */
+static bool RunPlayout(SearchSlot &s, Rng &rng)
+{
+	if(s.stop.load(std::memory_order_relaxed))
+		return false;
+	if(s.playouts.fetch_add(1, std::memory_order_relaxed) >= s.limit)
+		return false;
+	if(s.config.budget_us && Clock::now() > s.deadline)
+		return false;
+
+	unsigned path[tree_depth + 1];
+	unsigned length = 0;
+	Bitboard b = s.root.b;
+	int reward = 0;
+	bool lost = false;
+	unsigned depth = 0;
+
+	TreeNode *node = &s.node[0];
+	node->visits.fetch_add(1, std::memory_order_relaxed);
+	path[length++] = 0;
+
+	while(depth < tree_depth){
+		unsigned char state = node->state.load(std::memory_order_acquire);
+		if(state == TreeNode::UNEXPANDED){
+			if(node->state.compare_exchange_strong(state, TreeNode::EXPANDING, std::memory_order_acquire))
+				ExpandNode(s, *node, b, depth);
+			break;
+		}
+		if(state == TreeNode::EXPANDING)
+			break;
+		if(node->child_count == 0){
+			lost = true;
+			break;
+		}
+
+		double log_visits = std::log((double) node->visits.load(std::memory_order_relaxed));
+		unsigned pick = node->first_child;
+		double pick_score = -1.0;
+		for(unsigned i = 0; i < node->child_count; i++){
+			TreeNode &child = s.node[node->first_child + i];
+			unsigned visits = child.visits.load(std::memory_order_relaxed);
+			if(visits == 0){
+				pick = node->first_child + i;
+				break;
+			}
+
+			double mean = (double) child.value.load(std::memory_order_relaxed) / reward_one / visits;
+			double score = mean + explore * std::sqrt(log_visits / visits);
+			if(score > pick_score){
+				pick_score = score;
+				pick = node->first_child + i;
+			}
+		}
+
+		node = &s.node[pick];
+		node->visits.fetch_add(1, std::memory_order_relaxed);
+		path[length++] = pick;
+
+		DropResult drop;
+		if(!PlayDrop(s.table, s.generation, b, node->at, s.root.couples[depth][0], s.root.couples[depth][1], drop)){
+			lost = true;
+			break;
+		}
+		b = drop.b;
+		reward += DropReward(drop);
+		depth++;
+	}
+
+	if(!lost)
+		lost = !Rollout(s, b, depth, reward, rng);
+
+	unsigned long long value = lost ? 0 : SquashReward(reward);
+	for(unsigned i = 0; i < length; i++)
+		s.node[path[i]].value.fetch_add(value, std::memory_order_relaxed);
+
+	s.done.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+/* Gives node a child for every placement of its couple. The arena is a
+ * full tree's worth, so it never runs out. */
+static void ExpandNode(SearchSlot &s, TreeNode &node, const Bitboard &b, unsigned depth)
+{
+	PlacementList placements;
+	ListPlacements(b, s.root.couples[depth][0], s.root.couples[depth][1], placements);
+
+	unsigned first = s.node_count.fetch_add(placements.count, std::memory_order_relaxed);
+	for(unsigned i = 0; i < placements.count; i++){
+		TreeNode &child = s.node[first + i];
+		child.at = placements.placement[i];
+		child.child_count = 0;
+		child.state.store(TreeNode::UNEXPANDED, std::memory_order_relaxed);
+		child.visits.store(0, std::memory_order_relaxed);
+		child.value.store(0, std::memory_order_relaxed);
+	}
+
+	node.first_child = first;
+	node.child_count = placements.count;
+	node.state.store(TreeNode::EXPANDED, std::memory_order_release);
+}
+
+/* Plays out the couples left from depth on, the ones the seat can see and
+ * then rollout_depth drawn at random, and adds what they're worth to
+ * reward. Returns false if the board tops out. */
+static bool Rollout(SearchSlot &s, Bitboard &b, unsigned depth, int &reward, Rng &rng)
+{
+	for(unsigned d = depth; d < tree_depth + s.config.rollout_depth; d++){
+		PieceColor c0, c1;
+		if(d < tree_depth){
+			c0 = s.root.couples[d][0];
+			c1 = s.root.couples[d][1];
+		}
+		else{
+			c0 = (PieceColor) RandomBelow(rng, 5);
+			c1 = (PieceColor) RandomBelow(rng, 5);
+		}
+
+		PlacementList placements;
+		if(ListPlacements(b, c0, c1, placements) == 0)
+			return false;
+
+		DropResult drop;
+		if(s.config.greedy_playouts){
+			DropResult tried;
+			int best = 0;
+			bool found = false;
+			for(unsigned i = 0; i < placements.count; i++){
+				if(!PlayDrop(s.table, s.generation, b, placements.placement[i], c0, c1, tried))
+					continue;
+
+				int score = DropReward(tried) + EvaluateBoard(tried.b);
+				if(!found || score > best){
+					best = score;
+					drop = tried;
+					found = true;
+				}
+			}
+			if(!found)
+				return false;
+		}
+		else if(!PlayDrop(s.table, s.generation, b, placements.placement[RandomBelow(rng, placements.count)], c0, c1, drop))
+			return false;
+
+		b = drop.b;
+		reward += DropReward(drop);
+	}
+
+	if(b.occupied & spawn_cells)
+		return false;
+
+	reward += EvaluateBoard(b);
+	return true;
+}
+
+// Background ////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* Starts player thinking about the couple that just spawned, on the
+ * search pool's helpers, if it's set to and there's a slot free. Whatever
+ * it was still thinking about the last couple is called off first. */
+void StartThinking(Match *match, int player)
+{
+	Match::Board &board = match->board[player];
+	SearchPool *pool = match->search;
+
+	StopThinking(match, player);
+	board.plan.ready = false;
+
+	if(!board.ai.background || pool == NULL || pool->helpers.empty() || match->active_couple[player] == NULL)
+		return;
+
+	SearchSlot *slot = TakeSlot(pool);
+	if(slot == NULL)
+		return;
+
+	OpenSearch(*slot, match, player);
+	board.plan.job = slot;
+	ShareSlot(pool, *slot);
+}
+
+void StopThinking(Match *match, int player)
+{
+	if(match->board[player].plan.job)
+		FinishThinking(match, player);
+}
+
+/* The best move the background search has come up with so far. */
+static bool ReadAnswer(SearchSlot &s, Placement &best)
+{
+	if(s.mode == AI_MCTS)
+		return TreeAnswer(s, best);
+
+	int packed = s.beam_answer.load(std::memory_order_acquire);
+	if(packed < 0)
+		return false;
+	best = UnpackPlacement(packed);
+	return true;
+}
+
+static bool DoneThinking(SearchSlot &s)
+{
+	if(s.config.budget_us && Clock::now() > s.deadline)
+		return true;
+	if(s.mode == AI_MCTS)
+		return s.done.load(std::memory_order_acquire) >= s.limit;
+	return s.beam_done.load(std::memory_order_acquire);
+}
+
+/* Takes the background search's answer as the seat's move and lets its
+ * slot go. Never waits: helpers still in it finish their playout and the
+ * last one out frees it. */
+static void FinishThinking(Match *match, int player)
+{
+	Match::Board &board = match->board[player];
+	SearchSlot &s = *board.plan.job;
+
+	s.stop = true;
+	CloseSlot(match->search, s);
+
+	ThinkResult result;
+	result.best = s.root.fallback;
+	ReadAnswer(s, result.best);
+	if(s.mode == AI_MCTS){
+		result.nodes = s.done.load(std::memory_order_relaxed);
+		result.finished = result.nodes >= s.limit;
+	}
+	else{
+		result.nodes = s.beam_nodes.load(std::memory_order_relaxed);
+		result.finished = s.beam_done.load(std::memory_order_acquire) && s.beam_finished.load(std::memory_order_relaxed);
+	}
+	RecordThought(board, result, Clock::now() - s.started);
+
+	board.plan.target = result.best;
+	board.plan.ready = true;
+	board.plan.job = NULL;
+	ReleaseSlot(s);
+}
+
+// Search Pool ///////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+static SearchSlot *MakeSlots(unsigned count)
+{
+	SearchSlot *slots = new SearchSlot[count];
+	for(unsigned i = 0; i < count; i++){
+		slots[i].taken = false;
+		slots[i].open = false;
+		slots[i].inside = 0;
+		slots[i].releasing = false;
+		slots[i].stop = false;
+		slots[i].node = new TreeNode[max_tree_nodes];
+	}
+	return slots;
+}
+
+/* A free slot for a seat about to think, or NULL. */
+static SearchSlot *TakeSlot(SearchPool *pool)
+{
+	for(unsigned i = 0; i < pool->slot_count; i++){
+		bool expected = false;
+		if(pool->slot[i].taken.compare_exchange_strong(expected, true))
+			return &pool->slot[i];
+	}
+	return NULL;
+}
+
+/* Lets the helpers in on s. */
+static void ShareSlot(SearchPool *pool, SearchSlot &s)
+{
+	s.open = true;
+	std::lock_guard<std::mutex> hold(pool->lock);
+	pool->open_count++;
+	pool->wake.notify_all();
+}
+
+/* Keeps any more helpers out of s. Whoever gets there first, seat or
+ * helper, does it. */
+static void CloseSlot(SearchPool *pool, SearchSlot &s)
+{
+	if(s.open.exchange(false))
+		pool->open_count--;
+}
+
+/* A helper done with s; frees it if the seat already let go. */
+static void LeaveSlot(SearchSlot &s)
+{
+	if(--s.inside == 0 && s.releasing.exchange(false))
+		s.taken = false;
+}
+
+/* The seat done with s; frees it unless a helper is still in there. */
+static void ReleaseSlot(SearchSlot &s)
+{
+	s.releasing = true;
+	if(s.inside == 0 && s.releasing.exchange(false))
+		s.taken = false;
+}
+
+/* Stopping only happens with every search shut, so a helper only needs
+ * to look for it while it's asleep. */
+static void RunSearchHelper(SearchPool *pool)
+{
+	for(;;){
+		if(pool->open_count == 0){
+			std::unique_lock<std::mutex> hold(pool->lock);
+			while(!pool->stopping && pool->open_count == 0)
+				pool->wake.wait(hold);
+			if(pool->stopping)
+				return;
+		}
+
+		SearchSlot &s = pool->slot[pool->turn++ % pool->slot_count];
+		if(!s.open)
+			continue;
+
+		/* Checked again once inside, so a search that shuts in between
+		 * either sees us or we see it shut. */
+		s.inside++;
+		if(s.open && s.mode == AI_BEAM){
+			/* A beam is one helper's job from start to end. */
+			if(!s.beam_taken.exchange(true)){
+				CloseSlot(pool, s);
+
+				ThinkResult result;
+				RunBeam(s.root, s.config, s.deadline, s.table, &s, result);
+				s.beam_nodes.store(result.nodes, std::memory_order_relaxed);
+				s.beam_answer.store(PackPlacement(result.best), std::memory_order_relaxed);
+				s.beam_finished.store(result.finished, std::memory_order_relaxed);
+				s.beam_done.store(true, std::memory_order_release);
+			}
+		}
+		else if(s.open){
+			Rng rng;
+			SeedRng(rng, s.seed + (unsigned long long) ++s.batches * 0x9E3779B97F4A7C15ULL);
+			for(unsigned i = 0; i < helper_batch; i++){
+				if(!RunPlayout(s, rng)){
+					CloseSlot(pool, s);
+					break;
+				}
+			}
+		}
+		LeaveSlot(s);
+	}
+}
+
+/* helpers threads shared between up to searches seats thinking at once:
+ * however many threads step the match's boards, or every seat if they
+ * think in the background. Every tree is made here, so nothing is
+ * allocated once play starts. A pool with no helpers only holds the
+ * trees, and each seat searches alone on its own thread. */
+SearchPool *StartSearchPool(unsigned helpers, unsigned searches)
+{
+	if(searches < 1)
+		searches = 1;
+
+	SearchPool *pool = new SearchPool();
+	pool->stopping = false;
+	pool->open_count = 0;
+	pool->turn = 0;
+	pool->slot_count = searches;
+	pool->slot = MakeSlots(searches);
+
+	for(unsigned t = 0; t < helpers; t++)
+		pool->helpers.push_back(std::thread(RunSearchHelper, pool));
+
+	return pool;
+}
+
+/* Every search has to be stopped first; CleanMatch sees to that. */
+void StopSearchPool(SearchPool *pool)
+{
+	if(pool == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> hold(pool->lock);
+		pool->stopping = true;
+	}
+	pool->wake.notify_all();
+
+	for(unsigned t = 0; t < pool->helpers.size(); t++)
+		pool->helpers[t].join();
+
+	for(unsigned i = 0; i < pool->slot_count; i++)
+		delete[] pool->slot[i].node;
+	delete[] pool->slot;
+	delete pool;
+}
+
+// CPU ///////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* Presses whatever gets couple closer to target: rotate until it faces
+ * the right way, only then slide to the column, then hold down. Turning
+ * first is the order ListPlacements plans in; StepBoard turns before it
+ * slides, so a rotate and a slide pressed together would be the other. */
+static void Steer(Couple *couple, const Placement &target, PlayerInput &in)
+{
+	Piece *p1 = couple->p[0];
+
+	if(couple->orientation != target.orientation){
+		in.rotate = true;
+		return;
+	}
+
+	if(p1->x > target.x)
+		in.left = true;
+	else if(p1->x < target.x)
+		in.right = true;
+	else
+		in.down = true;
+}
+
+/* Plans once per couple and steers to the plan. A seat thinking in the
+ * background never waits on it here, unless the match says to: until it's
+ * done the couple is left where it spawned, since steering toward an
+ * answer that may still change could take it somewhere the final one
+ * can't be reached from, and the tick moves on. */
+void CPUTick(Match *match, int player, PlayerInput &in)
+{
+	Couple *couple = match->active_couple[player];
+	Match::Board &board = match->board[player];
+
+	in.left = in.right = in.down = in.rotate = false;
+	if(couple == NULL)
+		return;
+
+	if(!board.plan.ready && board.plan.job){
+		if(match->wait_for_thinking){
+			while(!DoneThinking(*board.plan.job))
+				std::this_thread::yield();
+		}
+		else if(!DoneThinking(*board.plan.job))
+			return;
+		FinishThinking(match, player);
+	}
+
+	if(!board.plan.ready){
+		Clock::time_point started = Clock::now();
+		ThinkResult result;
+		ThinkNow(match, player, result);
+		RecordThought(board, result, Clock::now() - started);
+
+		board.plan.target = result.best;
+		board.plan.ready = true;
+	}
+
+	Steer(couple, board.plan.target, in);
+}
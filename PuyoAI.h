@@ -0,0 +1,59 @@
+#ifndef PUYO_AI_H
+#define PUYO_AI_H
+
+/* The CPU player. On each new couple it runs a beam search over every
+ * placement of the active couple and the preview queue, playing each drop
+ * out with SimulateDrop. Then CPUTick steers the couple to the winner with
+ * ordinary PlayerInput, one press at a time.
+ *
+ * Boards the search reaches twice, by different placements or move orders,
+ * are told apart by their Zobrist key and only the better one is kept.
+ * Chains it has played out once go in a TranspositionTable that every CPU
+ * seat of a match, on whichever thread, reads and writes without locks.
+ *
+ * Seats set to AI_MCTS grow a Monte Carlo tree over the same placements
+ * instead, with playouts that run on past the preview, and play the
+ * placement tried most. Their trees live in a SearchPool, which can also
+ * lend them helper threads that all work on one tree at once; without a
+ * pool they play the beam.
+ *
+ * Either search can also run in the background, on the pool's helpers,
+ * from the moment a couple spawns (StartThinking). CPUTick then never
+ * waits on it: the couple waits where it spawned and is only steered
+ * once the search is done or out of time. Each seat
+ * keeps AIStats on how long it thought, how much it looked at and how
+ * often it ran out of time. */
+
+#include <cstddef>
+
+#include "PuyoCore.h"
+
+static const unsigned max_beam_width = 64;
+
+/* How a TranspositionTable has been doing since it was started. A probe is
+ * a drop that set off a chain. An occupied miss is a probe that found its
+ * slots held by other boards, or caught one mid-write; a collision is one
+ * that found an entry under its own key left by a different board. */
+struct TableStats{
+	unsigned long long probes;
+	unsigned long long hits;
+	unsigned long long occupied_misses;
+	unsigned long long collisions;
+	unsigned long long stores;
+	unsigned long long replaced; // stores that evicted another board's chain
+};
+
+// AI -----------------------------------
+int EvaluateBoard(const Bitboard &);
+Placement FindBestPlacement(Match *, int);
+
+// Transposition Table ------------------
+TranspositionTable *StartTranspositionTable(std::size_t);
+void StopTranspositionTable(TranspositionTable *);
+TableStats GetTableStats(const TranspositionTable *);
+
+// Search Pool --------------------------
+SearchPool *StartSearchPool(unsigned, unsigned);
+void StopSearchPool(SearchPool *);
+
+#endif
@@ -0,0 +1,590 @@
+#ifndef PUYO_BOARD_H
+#define PUYO_BOARD_H
+
+/* The board engine: bitboards, steering couples around them and playing
+ * drops out, for any board of up to 128 cells. It's all a template on the
+ * board's width and height, so every mask is a compile-time constant and
+ * every loop over rows or columns has a fixed count the compiler can
+ * unroll. PuyoCore.h picks the size a Match is played at. */
+
+#include <cstddef>
+
+// Types /////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+enum Direction{ LEFT = 0, RIGHT, UP, DOWN, ROTATE};
+enum PieceColor{ BLUE, GREEN, ORANGE, YELLOW, PURPLE, OJAMM };
+
+/* One bit per board cell, column-major: cell (x,y) is bit x*height+y, so
+ * "down" is a shift by one and "right" is a shift by a column height. A 6x12
+ * board needs 72 bits and an 8x16 one all 128, which gcc's 128-bit integer
+ * gives us in two words. */
+typedef unsigned __int128 BoardMask;
+
+/* The settled contents of a board: one mask per PieceColor and the union of
+ * them, and the board's Zobrist hash. 128 bytes, instead of a grid of
+ * pointers out into the heap. Everything that puts pieces down, takes them
+ * off or moves them keeps hash up to date as it goes; an empty board
+ * hashes to 0. */
+struct Bitboard{
+	BoardMask color[OJAMM+1];
+	BoardMask occupied;
+	unsigned long long hash;
+};
+
+/* How far each piece has fallen since the record was last cleared, indexed
+ * by cell the same way as a BoardMask bit, so the renderer can ease pieces
+ * down into the spots the simulation already settled them in. */
+struct FallInfo{
+	unsigned char drop[sizeof(BoardMask) * 8];
+};
+
+/* Where a couple comes to rest: the column of its first piece and which
+ * side of it the second piece sits on (RIGHT, UP, LEFT or DOWN). */
+struct Placement{
+	int x;
+	Direction orientation;
+};
+
+/* A same-colored connected run of four or more, and the ojamms bordering it
+ * that pop along with it. */
+struct PuyoGroup{
+	PieceColor color;
+	BoardMask cells;
+	BoardMask ojamms;
+};
+
+struct Offset{
+	int x, y;
+};
+
+/* One cell in each Direction. Doubles as where a couple's second piece sits
+ * relative to its pivot, for each orientation. */
+static constexpr Offset direction_offset[4] = {
+	{ -1,  0 }, // LEFT
+	{  1,  0 }, // RIGHT
+	{  0, -1 }, // UP
+	{  0,  1 }, // DOWN
+};
+
+/* Right becomes up becomes left becomes down becomes right. */
+static constexpr Direction rotated[4] = {
+	DOWN,  // from LEFT
+	UP,    // from RIGHT
+	LEFT,  // from UP
+	RIGHT, // from DOWN
+};
+
+/* When the cell a turn swings into is taken, by a wall or a piece, the
+ * pivot is pushed one cell the other way and the turn tried again. Indexed
+ * by the orientation being turned to. */
+static constexpr Offset rotation_kick[4] = {
+	{  1,  0 }, // to LEFT: off the left wall
+	{ -1,  0 }, // to RIGHT: off the right wall
+	{  0,  1 }, // to UP: down off the ceiling
+	{  0, -1 }, // to DOWN: up off the stack
+};
+
+// Bits //////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+inline int LowestBit(BoardMask m)
+{
+	unsigned long long lo = (unsigned long long) m;
+	if(lo)
+		return __builtin_ctzll(lo);
+	return 64 + __builtin_ctzll((unsigned long long) (m >> 64));
+}
+
+inline int CountBits(BoardMask m)
+{
+	return __builtin_popcountll((unsigned long long) m) +
+	       __builtin_popcountll((unsigned long long) (m >> 64));
+}
+
+/* Row y of a width by height board. */
+template<int W, int H>
+constexpr BoardMask RowMask(int y)
+{
+	BoardMask m = 0;
+	for(int x = 0; x < W; x++)
+		m |= (BoardMask) 1 << (x * H + y);
+	return m;
+}
+
+// Zobrist ///////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* A random key for every color in every cell a BoardMask has, and one for
+ * each amount of garbage queued against a board. A board's hash is the xor
+ * of the keys of its pieces, so putting a piece down or taking it off is
+ * one xor either way. More than a board's worth of garbage is a loss
+ * whatever the amount, so it all shares the last key. */
+struct ZobristKeys{
+	static const unsigned max_cells = sizeof(BoardMask) * 8;
+	static const unsigned max_garbage = max_cells;
+
+	unsigned long long cell[OJAMM+1][max_cells];
+	unsigned long long garbage[max_garbage + 1];
+};
+
+/* splitmix64 from a fixed seed, worked out by the compiler, so every build
+ * and every thread hashes the same board the same way. */
+constexpr unsigned long long SplitMix(unsigned long long &seed)
+{
+	unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+constexpr ZobristKeys MakeZobristKeys()
+{
+	ZobristKeys keys = {};
+	unsigned long long seed = 0x50555930u;
+
+	for(unsigned c = 0; c <= OJAMM; c++){
+		for(unsigned i = 0; i < ZobristKeys::max_cells; i++)
+			keys.cell[c][i] = SplitMix(seed);
+	}
+	for(unsigned i = 0; i <= ZobristKeys::max_garbage; i++)
+		keys.garbage[i] = SplitMix(seed);
+
+	return keys;
+}
+
+static constexpr ZobristKeys zobrist = MakeZobristKeys();
+
+/* The xor of color's keys over every cell in m. */
+inline unsigned long long HashCells(BoardMask m, PieceColor color)
+{
+	unsigned long long hash = 0;
+	for(; m; m &= m - 1)
+		hash ^= zobrist.cell[color][LowestBit(m)];
+	return hash;
+}
+
+/* A board and the garbage queued against it, as one key. */
+inline unsigned long long PositionKey(const Bitboard &b, int pending)
+{
+	if(pending < 0)
+		pending = 0;
+	if(pending > (int) ZobristKeys::max_garbage)
+		pending = ZobristKeys::max_garbage;
+	return b.hash ^ zobrist.garbage[pending];
+}
+
+// Rules (PuyoCore.cpp) ----------------
+int OjammsForGroup(int);
+
+// Engine ////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+template<int W, int H>
+struct BoardEngine{
+	/* Columns are unpacked into an unsigned to settle them, and placements
+	 * are deduplicated in a 64-bit set of column and orientation. */
+	static_assert(W >= 2 && H >= 2, "a couple has to fit on the board");
+	static_assert(W * H <= 128, "the board has to fit in a BoardMask");
+	static_assert(H < 32 && W <= 16, "columns and placements are kept in machine words");
+
+	static const int width = W;
+	static const int height = H;
+	static const int spawn_x = (W - 1) / 2; // the pivot; the second piece starts to its right
+
+	static constexpr BoardMask full_mask = W * H == 128 ? ~(BoardMask) 0 : ((BoardMask) 1 << (W * H % 128)) - 1;
+	static constexpr BoardMask top_row = RowMask<W,H>(0);
+	static constexpr BoardMask bottom_row = RowMask<W,H>(H - 1);
+	static constexpr unsigned column_bits = (1u << H) - 1;
+
+	/* Every group that pops on a board at once. Each popping group needs
+	 * four cells of its own, so the list can never outgrow a quarter of
+	 * the board. */
+	struct GroupList{
+		static const unsigned max_groups = W * H / 4;
+
+		unsigned count;
+		PuyoGroup group[max_groups];
+	};
+
+	/* Every distinct place a couple can end up: each horizontal orientation
+	 * in all but one column, each vertical one in every column. */
+	struct PlacementList{
+		static const unsigned max_placements = 2 * (W - 1) + 2 * W;
+
+		unsigned count;
+		Placement placement[max_placements];
+	};
+
+	/* What landing a couple does to a board, worked out on a copy: the
+	 * board once everything has stopped, how many steps the chain ran, how
+	 * many groups popped at each step and how much garbage it all sends.
+	 * Fits in a couple of cache lines and lives wherever the caller puts
+	 * it. */
+	struct DropResult{
+		static const unsigned max_steps = GroupList::max_groups;
+
+		Bitboard b;
+		int chain;
+		int ojamms;
+		unsigned char groups[max_steps];
+	};
+
+	// Bitboard -----------------------------
+
+	static BoardMask CellMask(int x, int y)
+	{
+		return (BoardMask) 1 << (x * H + y);
+	}
+
+	/* Every cell orthogonally adjacent to one in m. Shifting by one moves
+	 * within a column, so the row that would wrap into the next column is
+	 * masked off. */
+	static BoardMask Neighbours(BoardMask m)
+	{
+		BoardMask up    = (m & ~top_row) >> 1;
+		BoardMask down  = (m & ~bottom_row) << 1;
+		BoardMask left  = m >> H;
+		BoardMask right = m << H;
+		return (up | down | left | right) & full_mask;
+	}
+
+	/* Grow seed through the cells of within, one ring at a time. Only the
+	 * newly reached frontier is expanded, so every cell is visited once. */
+	static BoardMask FloodFill(BoardMask seed, BoardMask within)
+	{
+		BoardMask group = seed & within;
+		BoardMask frontier = group;
+
+		while(frontier){
+			frontier = Neighbours(frontier) & within & ~group;
+			group |= frontier;
+		}
+
+		return group;
+	}
+
+	/* Labels the connected groups touching dirty and keeps the ones big
+	 * enough to pop. On a board that had nothing to pop before, only a
+	 * group with a piece that just landed or moved can pop now, so passing
+	 * those cells as dirty finds exactly what a scan of the whole board
+	 * would, for the cost of the groups they touch. Groups come out lowest
+	 * cell first, the same order the old column-major grid scan found them
+	 * in; an ojamm bordering several groups is given to the first. Ojamms
+	 * join a group but never grow it. */
+	static unsigned FindPoppingGroups(const Bitboard &b, GroupList &list, BoardMask dirty = full_mask)
+	{
+		list.count = 0;
+		if(dirty == 0)
+			return 0;
+
+		/* A color with fewer than four pieces on the board can't pop at
+		 * all. */
+		BoardMask unvisited = 0;
+		for(unsigned c = 0; c < OJAMM; c++){
+			if(CountBits(b.color[c]) >= 4)
+				unvisited |= b.color[c];
+		}
+		unvisited &= dirty;
+
+		while(unvisited)
+		{
+			BoardMask seed = unvisited & -unvisited;
+			unsigned color = 0;
+			while((b.color[color] & seed) == 0)
+				color++;
+
+			BoardMask cells = FloodFill(seed, b.color[color]);
+			unvisited &= ~cells;
+
+			if(CountBits(cells) < 4)
+				continue;
+
+			/* Groups are disjoint, so comparing lowest bits orders them.
+			 * Seeds from a full scan already arrive in order. */
+			BoardMask lowest = cells & -cells;
+			unsigned i = list.count++;
+			while(i > 0 && (list.group[i-1].cells & -list.group[i-1].cells) > lowest){
+				list.group[i] = list.group[i-1];
+				i--;
+			}
+			list.group[i].color = (PieceColor) color;
+			list.group[i].cells = cells;
+		}
+
+		BoardMask claimed_ojamms = 0;
+		for(unsigned g = 0; g < list.count; g++){
+			list.group[g].ojamms = Neighbours(list.group[g].cells) & b.color[OJAMM] & ~claimed_ojamms;
+			claimed_ojamms |= list.group[g].ojamms;
+		}
+
+		return list.count;
+	}
+
+	/* One unsigned compare per axis covers both walls. */
+	static bool CellFree(const Bitboard &b, int x, int y)
+	{
+		if((unsigned) x >= (unsigned) W || (unsigned) y >= (unsigned) H)
+			return false;
+
+		return (b.occupied & CellMask(x,y)) == 0;
+	}
+
+	static void PlacePiece(Bitboard &b, int x, int y, PieceColor color)
+	{
+		BoardMask cell = CellMask(x,y);
+		b.color[color] |= cell;
+		b.occupied |= cell;
+		b.hash ^= zobrist.cell[color][x * H + y];
+	}
+
+	/* Puts down color in every cell of cells, which have to be empty. */
+	static void AddPieces(Bitboard &b, BoardMask cells, PieceColor color)
+	{
+		b.color[color] |= cells;
+		b.occupied |= cells;
+		b.hash ^= HashCells(cells, color);
+	}
+
+	static void RemovePieces(Bitboard &b, BoardMask cells)
+	{
+		for(unsigned c = 0; c <= OJAMM; c++){
+			b.hash ^= HashCells(b.color[c] & cells, (PieceColor) c);
+			b.color[c] &= ~cells;
+		}
+		b.occupied &= ~cells;
+	}
+
+	/* Compacts every column to its resting state in one pass: each column
+	 * is walked bottom up once and its pieces are restacked in order.
+	 * Columns that are already packed are skipped outright. When landed is
+	 * given, each moved piece's drop is added to the drop of the cell it
+	 * came from. Returns the cells pieces moved into, empty if nothing
+	 * moved. */
+	static BoardMask SettleBoard(Bitboard &b, FallInfo *landed)
+	{
+		BoardMask moved = 0;
+
+		for(int x = 0; x < W; x++){
+			int shift = x * H;
+			unsigned column = (unsigned) (b.occupied >> shift) & column_bits;
+			int count = __builtin_popcount(column);
+			unsigned packed = column_bits & ~(column_bits >> count);
+
+			if(column == packed)
+				continue;
+
+			unsigned colors[OJAMM+1];
+			unsigned settled[OJAMM+1];
+			unsigned fell = 0;
+			for(unsigned c = 0; c <= OJAMM; c++){
+				colors[c] = (unsigned) (b.color[c] >> shift) & column_bits;
+				settled[c] = 0;
+			}
+
+			int dest = H - 1;
+			for(int y = H - 1; y >= 0; y--){
+				unsigned bit = 1u << y;
+				if((column & bit) == 0)
+					continue;
+
+				unsigned c = 0;
+				while((colors[c] & bit) == 0)
+					c++;
+
+				settled[c] |= 1u << dest;
+				if(dest != y){
+					fell |= 1u << dest;
+					b.hash ^= zobrist.cell[c][shift + y] ^ zobrist.cell[c][shift + dest];
+				}
+				if(landed)
+					landed->drop[shift + dest] = landed->drop[shift + y] + (dest - y);
+				dest--;
+			}
+
+			BoardMask keep = ~((BoardMask) column_bits << shift);
+			for(unsigned c = 0; c <= OJAMM; c++)
+				b.color[c] = (b.color[c] & keep) | ((BoardMask) settled[c] << shift);
+			b.occupied = (b.occupied & keep) | ((BoardMask) packed << shift);
+			moved |= (BoardMask) fell << shift;
+		}
+
+		return moved;
+	}
+
+	static int ColumnHeight(const Bitboard &b, int x)
+	{
+		return __builtin_popcount((unsigned) (b.occupied >> (x * H)) & column_bits);
+	}
+
+	/* Orthogonally adjacent pairs within m, each counted once. */
+	static int CountAdjacentPairs(BoardMask m)
+	{
+		BoardMask vertical = m & ((m & ~bottom_row) << 1);
+		BoardMask horizontal = m & (m << H);
+		return CountBits(vertical) + CountBits(horizontal);
+	}
+
+	// Movement -----------------------------
+
+	/* Whether a couple with its pivot at (x,y) facing orientation lies
+	 * wholly on the board and clear of anything settled. */
+	static bool CoupleFits(const Bitboard &b, int x, int y, Direction orientation)
+	{
+		const Offset &d = direction_offset[orientation];
+		return CellFree(b, x, y) && CellFree(b, x + d.x, y + d.y);
+	}
+
+	/* Turns a couple, kicking it if it has to. Leaves it alone and returns
+	 * false if it can't turn either way. */
+	static bool RotateCouple(const Bitboard &b, int &x, int &y, Direction &orientation)
+	{
+		Direction to = rotated[orientation];
+
+		if(CoupleFits(b, x, y, to)){
+			orientation = to;
+			return true;
+		}
+
+		int kx = x + rotation_kick[to].x;
+		int ky = y + rotation_kick[to].y;
+		if(CoupleFits(b, kx, ky, to)){
+			x = kx;
+			y = ky;
+			orientation = to;
+			return true;
+		}
+
+		return false;
+	}
+
+	/* Every distinct place a freshly spawned couple can be steered to
+	 * before it drops, the way the CPU steers it: turned first, kicks
+	 * included, until it faces the right way, and only then slid as far as
+	 * it needs to go. Every turn after the first starts where the last one
+	 * left the couple, so each facing is reached from one spot only. A
+	 * couple of two same-colored pieces looks the same either way round,
+	 * so those placements are only listed once, as whichever facing is
+	 * found first. */
+	static unsigned ListPlacements(const Bitboard &b, PieceColor c0, PieceColor c1, PlacementList &list)
+	{
+		unsigned long long listed = 0;
+
+		list.count = 0;
+		if(!CoupleFits(b, spawn_x, 0, RIGHT))
+			return 0;
+
+		int x = spawn_x;
+		int y = 0;
+		Direction orientation = RIGHT;
+
+		for(unsigned turns = 0; turns < 4; turns++){
+			if(turns > 0 && !RotateCouple(b, x, y, orientation))
+				break;
+
+			for(int step = -1; step <= 1; step += 2){
+				for(int sx = step < 0 ? x : x + 1; CoupleFits(b, sx, y, orientation); sx += step){
+					/* Same-colored couples: a left facing is a right one a
+					 * column over, and down is up. */
+					Placement seen = { sx, orientation };
+					if(c0 == c1 && seen.orientation == LEFT){
+						seen.x--;
+						seen.orientation = RIGHT;
+					}
+					else if(c0 == c1 && seen.orientation == DOWN)
+						seen.orientation = UP;
+
+					unsigned long long bit = 1ull << (seen.x * 4 + seen.orientation);
+					if(listed & bit)
+						continue;
+
+					listed |= bit;
+					Placement at = { sx, orientation };
+					list.placement[list.count++] = at;
+				}
+			}
+		}
+
+		return list.count;
+	}
+
+	// Simulation ---------------------------
+
+	/* Lands a couple on a settled board. Each piece comes to rest on top of
+	 * its column, so no settle is needed afterwards. Fails if there isn't
+	 * room. */
+	static bool DropCouple(Bitboard &b, const Placement &at, PieceColor c0, PieceColor c1)
+	{
+		int x2 = at.x + direction_offset[at.orientation].x;
+
+		if(at.x == x2){
+			int top = H - 1 - ColumnHeight(b, at.x);
+			if(top < 1)
+				return false;
+
+			/* UP puts the second piece on top of the first. */
+			PieceColor lower = at.orientation == UP ? c0 : c1;
+			PieceColor upper = at.orientation == UP ? c1 : c0;
+			PlacePiece(b, at.x, top, lower);
+			PlacePiece(b, at.x, top - 1, upper);
+			return true;
+		}
+
+		int top1 = H - 1 - ColumnHeight(b, at.x);
+		int top2 = H - 1 - ColumnHeight(b, x2);
+		if(top1 < 0 || top2 < 0)
+			return false;
+
+		PlacePiece(b, at.x, top1, c0);
+		PlacePiece(b, x2, top2, c1);
+		return true;
+	}
+
+	/* One step of a chain: takes every group touching dirty that pops, and
+	 * the ojamms they drag along, off the board. Leaves the board unsettled
+	 * and the groups in popped. Returns how many there were. */
+	static unsigned PopGroups(Bitboard &b, GroupList &popped, BoardMask dirty = full_mask)
+	{
+		if(FindPoppingGroups(b, popped, dirty) == 0)
+			return 0;
+
+		for(unsigned g = 0; g < popped.count; g++)
+			RemovePieces(b, popped.group[g].cells | popped.group[g].ojamms);
+
+		return popped.count;
+	}
+
+	/* Pops and settles result.b until nothing moves, the way a lock plays
+	 * out in the game but with no hooks, no neighbours and no animation.
+	 * dirty is what changed since the board last stood still; each step
+	 * after the first only looks at what fell. */
+	static void ResolveChain(DropResult &result, BoardMask dirty = full_mask)
+	{
+		GroupList popped;
+
+		result.chain = 0;
+		result.ojamms = 0;
+
+		while(PopGroups(result.b, popped, dirty)){
+			for(unsigned g = 0; g < popped.count; g++)
+				result.ojamms += OjammsForGroup(CountBits(popped.group[g].cells | popped.group[g].ojamms));
+
+			result.groups[result.chain++] = popped.count;
+			dirty = SettleBoard(result.b, NULL);
+		}
+	}
+
+	/* Everything that would happen if a couple landed at at on b, without
+	 * touching b. Returns false if the couple doesn't fit. */
+	static bool SimulateDrop(const Bitboard &b, const Placement &at, PieceColor c0, PieceColor c1, DropResult &result)
+	{
+		result.b = b;
+		if(!DropCouple(result.b, at, c0, c1))
+			return false;
+
+		ResolveChain(result, result.b.occupied & ~b.occupied);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,769 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "PuyoCore.h"
+
+// Random ////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* splitmix64 spreads any seed, even 0 or 1, over the full xoshiro state. */
+void SeedRng(Rng &rng, unsigned long long seed)
+{
+	for(unsigned i = 0; i < 4; i += 2){
+		unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		z = z ^ (z >> 31);
+		rng.s[i] = (unsigned) z;
+		rng.s[i+1] = (unsigned) (z >> 32);
+	}
+}
+
+static inline unsigned Rotl(unsigned x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+unsigned NextRandom(Rng &rng)
+{
+	unsigned *s = rng.s;
+	unsigned result = Rotl(s[1] * 5, 7) * 9;
+	unsigned t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = Rotl(s[3], 11);
+
+	return result;
+}
+
+/* Uniform in [0, n) by multiply-and-shift, which is cheaper than % and
+ * doesn't favour the low values. */
+unsigned RandomBelow(Rng &rng, unsigned n)
+{
+	return (unsigned) (((unsigned long long) NextRandom(rng) * n) >> 32);
+}
+
+// Match /////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* players is clamped to what a Match can hold. */
+void InitMatch(Match *match, unsigned long long seed, unsigned players)
+{
+	if(players < 2)
+		players = 2;
+	if(players > match->max_players)
+		players = match->max_players;
+
+	match->player_count = players;
+	match->playing = true;
+	match->now = 0;
+	match->time_limit_ms = 0;
+	match->seed = seed;
+
+	match->hooks.user = NULL;
+	match->hooks.on_pop = NULL;
+	match->hooks.on_chain = NULL;
+	match->hooks.on_locked = NULL;
+	match->pool = NULL;
+	match->table = NULL;
+	match->search = NULL;
+	match->wait_for_thinking = false;
+
+	for(unsigned p = 0; p < match->player_count; p++){
+		match->player_types[p] = CPU;
+		match->board[p].b = Bitboard();
+		match->board[p].fall = FallInfo();
+		match->board[p].fall_started = 0;
+		SeedRng(match->board[p].pieces, seed);
+		SeedRng(match->board[p].rng, seed ^ ((unsigned long long) (p + 1) << 56));
+
+		match->board[p].lost = false;
+		match->board[p].won = false;
+		match->board[p].score = 0;
+		match->board[p].ojamms_pending = 0;
+		match->board[p].ojamms_outgoing = 0;
+		match->board[p].event_count = 0;
+		match->active_couple[p] = NULL;
+		match->board[p].move_delay = 125;
+		match->board[p].last_forced_move = 0;
+		match->board[p].last_guided_move = 0;
+
+		for(unsigned n = 0; n < match->preview_count; n++){
+			match->board[p].next[n][0] = (PieceColor) RandomBelow(match->board[p].pieces, 5);
+			match->board[p].next[n][1] = (PieceColor) RandomBelow(match->board[p].pieces, 5);
+		}
+
+		match->board[p].ai.mode = AI_BEAM;
+		match->board[p].ai.beam_width = 8;
+		match->board[p].ai.depth = 1 + match->preview_count;
+		match->board[p].ai.playouts = 256;
+		match->board[p].ai.rollout_depth = 2;
+		match->board[p].ai.greedy_playouts = true;
+		match->board[p].ai.background = false;
+		match->board[p].ai.budget_us = 0;
+		match->board[p].plan.ready = false;
+		match->board[p].plan.job = NULL;
+		match->board[p].thought = AIStats();
+	}
+}
+
+/* Calls off anything still thinking, so the match's SearchPool is free
+ * for the next one. */
+void CleanMatch(Match *match)
+{
+	for(unsigned p = 0; p < match->player_count; p++){
+		StopThinking(match, p);
+		match->active_couple[p] = NULL;
+	}
+}
+
+/* Advances the match by one tick_ms of simulated time. Every board steps
+ * on its own, over match->pool's threads if it has one, and nothing one
+ * board does reaches another until FinishTick. So the outcome is the same
+ * whatever order, or however many threads, the boards ran on. */
+void StepMatch(Match *match, const MatchInput &input)
+{
+	if(!match->playing)
+		return;
+
+	match->now += match->tick_ms;
+
+	unsigned losers = 0;
+	for(unsigned p = 0; p < match->player_count; p++)
+		losers += match->board[p].lost;
+
+	if(match->pool)
+		RunBoards(match->pool, match, input);
+	else{
+		for(unsigned p = 0; p < match->player_count; p++)
+			StepBoard(match, p, input.player[p]);
+	}
+
+	FinishTick(match);
+
+	/* Seats can top out on the same tick, so everyone may be gone at once;
+	 * that ends the match as a draw rather than leaving it running. */
+	if(losers >= match->player_count - 1){
+		for(unsigned p = 0; p < match->player_count; p++){
+			if(match->board[p].lost != true)
+				match->board[p].won = true;
+		}
+		match->playing = false;
+	}
+	else if(match->time_limit_ms && match->now >= match->time_limit_ms)
+		match->playing = false; // a draw: nobody has won
+}
+
+/* One seat's share of a tick: its buttons, then a new couple or a step of
+ * gravity. Only reads and writes that seat's board. */
+void StepBoard(Match *match, int p, const PlayerInput &input)
+{
+	/* CPU seats press the same buttons a human would. */
+	PlayerInput in = input;
+	bool steered = true;
+	if(match->player_types[p] == CPU)
+		CPUTick(match, p, in);
+	else if(match->player_types[p] != HUM)
+		steered = false;
+
+	if(steered){
+		if(in.rotate)
+			MoveActiveCouple(match, p, ROTATE);
+
+		/* Held keys repeat every move_delay */
+		if(match->now - match->board[p].last_guided_move > match->board[p].move_delay)
+		{
+			if(in.down){
+				MoveActiveCouple(match, p, DOWN);
+				match->board[p].last_forced_move = match->now;
+			}
+			if(in.left)
+				MoveActiveCouple(match, p, LEFT);
+			if(in.right)
+				MoveActiveCouple(match, p, RIGHT);
+
+			match->board[p].last_guided_move = match->now;
+		}
+	}
+
+	if(match->board[p].lost == false && match->board[p].won == false){
+		if(match->active_couple[p] == NULL){
+			/* Spawn new random piece for our player. */
+			 match->active_couple[p] = GenerateNewCouple(match, p);
+
+			 int x1, x2, y1, y2;
+			 x1 = match->active_couple[p]->p[0]->x;
+			 x2 = match->active_couple[p]->p[1]->x;
+			 y1 = match->active_couple[p]->p[0]->y;
+			 y2 = match->active_couple[p]->p[1]->y;
+
+			 if(!CellFree(match->board[p].b, x1, y1) || !CellFree(match->board[p].b, x2, y2)){
+				 match->board[p].lost = true;
+				 match->active_couple[p] = NULL;
+			 }
+			 else if(match->player_types[p] == CPU)
+				 StartThinking(match, p);
+		} else {
+			if(match->now - match->board[p].last_forced_move > 500){
+				MoveActiveCouple(match, p, DOWN);
+				match->board[p].last_forced_move = match->now;
+			}
+		}
+	}
+	else if(match->board[p].lost){
+		OjammAttack(match,p);
+	}
+}
+
+Couple *GenerateNewCouple(Match *match, int player)
+{
+	if(!match)
+		return NULL;
+
+	if(match->max_players == 0)
+		return NULL;
+
+	Match::Board &board = match->board[player];
+	Couple *c = &board.couple;
+
+	/* Deal the head of the preview queue and top it back up. */
+	for(unsigned i = 0; i < 2; i++){
+		Piece *p = &board.couple_pieces[i];
+
+		p->color = board.next[0][i];
+		p->y = 0;
+
+		c->p[i] = p;
+	}
+
+	for(unsigned n = 1; n < match->preview_count; n++){
+		board.next[n-1][0] = board.next[n][0];
+		board.next[n-1][1] = board.next[n][1];
+	}
+	board.next[match->preview_count-1][0] = (PieceColor) RandomBelow(board.pieces, 5);
+	board.next[match->preview_count-1][1] = (PieceColor) RandomBelow(board.pieces, 5);
+	board.plan.ready = false;
+
+	c->orientation = RIGHT;
+	c->p[0]->x = MatchEngine::spawn_x;
+	c->p[1]->x = MatchEngine::spawn_x + direction_offset[RIGHT].x;
+
+	return c;
+}
+
+void MoveActiveCouple(Match* match, int player, Direction dir)
+{
+	Couple *active_couple = match->active_couple[player];
+	if(active_couple == NULL)
+		return;
+
+	Piece *p1 = active_couple->p[0];
+	Piece *p2 = active_couple->p[1];
+	
+	if(p1 == NULL || p2 == NULL)
+		return;
+
+	/* The couple isn't in the bitboard while it falls, so a move is legal
+	 * exactly when both destination cells are on the board and empty. */
+	Bitboard &b = match->board[player].b;
+	int x = p1->x;
+	int y = p1->y;
+	Direction orientation = active_couple->orientation;
+
+	if(dir == ROTATE){
+		if(!RotateCouple(b, x, y, orientation))
+			return;
+	}
+	else if(dir != UP){
+		x += direction_offset[dir].x;
+		y += direction_offset[dir].y;
+
+		if(!CoupleFits(b, x, y, orientation)){
+			if(dir == DOWN)
+				LockActiveCouple(match, player);
+			return;
+		}
+	}
+
+	active_couple->orientation = orientation;
+	p1->x = x;
+	p1->y = y;
+	p2->x = x + direction_offset[orientation].x;
+	p2->y = y + direction_offset[orientation].y;
+}
+
+/* The couple has landed: it joins the board, everything falls and pops
+ * until it stops, and whatever garbage is left over comes down. */
+void LockActiveCouple(Match *match, int player)
+{
+	Couple *active_couple = match->active_couple[player];
+	Piece *p1 = active_couple->p[0];
+	Piece *p2 = active_couple->p[1];
+	Bitboard &b = match->board[player].b;
+
+	PlacePiece(b, p1->x, p1->y, p1->color);
+	PlacePiece(b, p2->x, p2->y, p2->color);
+
+	match->active_couple[player] = NULL;
+
+	match->board[player].fall = FallInfo();
+	match->board[player].fall_started = match->now;
+
+	/* Only what landed, and then only what fell, can make a new group. */
+	BoardMask dirty = CellMask(p1->x, p1->y) | CellMask(p2->x, p2->y);
+	dirty |= FallPieces(match,player);
+
+	int chain = 0;
+	while(CheckForCombos(match,player,dirty)){
+		chain++;
+		dirty = FallPieces(match,player);
+	}
+
+	if(match->hooks.on_locked){
+		MatchEvent locked;
+		locked.kind = MatchEvent::LOCKED;
+		locked.value = chain;
+		RecordEvent(match, player, locked);
+	}
+	
+	OjammAttack(match,player);
+	match->board[player].last_forced_move = match->now;
+}
+
+/* Settles the board in one step, keeping track of how far things fell so
+ * DrawPuyos can animate it. Returns the cells that were fallen into. */
+BoardMask FallPieces(Match *match, int player)
+{
+	return SettleBoard(match->board[player].b, &match->board[player].fall);
+}
+
+/* Garbage sent for popping a group of size pieces, ojamms included. */
+int OjammsForGroup(int size)
+{
+	switch(size){
+	case 4:
+		return 1;
+	case 5:
+		return 3;
+	case 6:
+		return 5;
+	case 7:
+		return 6;
+	default:
+		return 1;
+	}
+}
+
+/* Drops target's pending garbage, up to max_ojamm_rows rows of it; the
+ * rest stays queued for its next lock. Whole rows cover every column and
+ * what's left over goes one each to columns drawn from the board's own
+ * stream. A column without room for its share passes the rest on, one at
+ * a time in that same order, to columns that still have room; whatever
+ * none of them can take goes back on the queue. The board is settled by
+ * now, so each column's share is stacked straight onto it as one mask and
+ * nothing needs to fall: a drop costs the same however many ojamms land.
+ * A board that's out passes its queue on instead. */
+void OjammAttack(Match *match, int target)
+{
+	Match::Board &board = match->board[target];
+
+	if(board.lost){
+		board.ojamms_outgoing += board.ojamms_pending;
+		board.ojamms_pending = 0;
+		return;
+	}
+
+	if(board.ojamms_pending <= 0)
+		return;
+
+	const int w = MatchEngine::width;
+	const int h = MatchEngine::height;
+
+	int count = board.ojamms_pending;
+	if(count > (int) (board.max_ojamm_rows * w))
+		count = board.max_ojamm_rows * w;
+	board.ojamms_pending -= count;
+
+	int share[w];
+	int order[w];
+	for(int x = 0; x < w; x++){
+		share[x] = count / w;
+		order[x] = x;
+	}
+
+	/* A partial shuffle, so the odd ones land in distinct columns. */
+	for(int i = 0; i < count % w; i++){
+		int j = i + RandomBelow(board.rng, w - i);
+		int swap = order[i];
+		order[i] = order[j];
+		order[j] = swap;
+		share[order[i]]++;
+	}
+
+	int room[w];
+	int overflow = 0;
+	for(int x = 0; x < w; x++){
+		room[x] = h - ColumnHeight(board.b, x);
+		if(share[x] > room[x]){
+			overflow += share[x] - room[x];
+			share[x] = room[x];
+		}
+	}
+
+	for(bool moved = true; overflow > 0 && moved; ){
+		moved = false;
+		for(int i = 0; i < w && overflow > 0; i++){
+			int x = order[i];
+			if(share[x] < room[x]){
+				share[x]++;
+				overflow--;
+				moved = true;
+			}
+		}
+	}
+	board.ojamms_pending += overflow;
+
+	BoardMask added = 0;
+	for(int x = 0; x < w; x++){
+		int free = room[x];
+		int k = share[x];
+		if(k == 0)
+			continue;
+
+		/* Rows free-k to free-1 sit right on the stack. They come in as
+		 * a block whose top starts at row 0. */
+		added |= (BoardMask) (((1u << k) - 1) << (free - k)) << (x * h);
+		for(int y = free - k; y < free; y++)
+			board.fall.drop[x * h + y] = free - k;
+	}
+
+	AddPieces(board.b, added, OJAMM);
+}
+
+/* Pops whatever groups touch dirty, the cells changed since the board last
+ * stood still. */
+bool CheckForCombos(Match *match, int player, BoardMask dirty)
+{
+	Bitboard &b = match->board[player].b;
+	GroupList popped;
+
+	if(PopGroups(b, popped, dirty) == 0)
+		return false;
+
+	for(unsigned g = 0; g < popped.count; g++)
+	{
+		// C-C-C-C-COMBO!
+		PuyoGroup &group = popped.group[g];
+		if(match->hooks.on_pop){
+			for(BoardMask m = group.cells | group.ojamms; m; m &= m - 1){
+				int cell = LowestBit(m);
+				MatchEvent pop;
+				pop.kind = MatchEvent::POP;
+				pop.x = cell / MatchEngine::height;
+				pop.y = cell % MatchEngine::height;
+				pop.color = (group.cells >> cell) & 1 ? group.color : OJAMM;
+				RecordEvent(match, player, pop);
+			}
+		}
+
+		int ojamms = OjammsForGroup(CountBits(group.cells | group.ojamms));
+
+		/* OJAMMS, AHOY! What's queued against us is offset first and
+		 * only the rest is sent on. */
+		int offset = ojamms < match->board[player].ojamms_pending ? ojamms : match->board[player].ojamms_pending;
+		match->board[player].ojamms_pending -= offset;
+		match->board[player].ojamms_outgoing += ojamms - offset;
+
+		if(match->hooks.on_chain){
+			MatchEvent sent;
+			sent.kind = MatchEvent::CHAIN;
+			sent.value = ojamms;
+			RecordEvent(match, player, sent);
+		}
+	}
+
+	return true;
+}
+
+/* Holds a hook call back until FinishTick. */
+void RecordEvent(Match *match, int player, const MatchEvent &event)
+{
+	Match::Board &board = match->board[player];
+	if(board.event_count < board.max_events)
+		board.events[board.event_count++] = event;
+}
+
+/* Who player's garbage goes to: an opponent still in, drawn from player's
+ * own stream. Nobody is stuck feeding the same neighbour all match, and
+ * nothing is wasted on a board that's already out. live holds the seats
+ * still in, in order. -1 if there's nobody to send to. */
+int PickTarget(Match *match, int player, const unsigned *live, unsigned live_count)
+{
+	Match::Board &board = match->board[player];
+
+	if(board.lost){
+		if(live_count == 0)
+			return -1;
+		return live[RandomBelow(board.rng, live_count)];
+	}
+
+	/* player is in live too: skip over it. */
+	if(live_count < 2)
+		return -1;
+	unsigned i = RandomBelow(board.rng, live_count - 1);
+	if(live[i] >= (unsigned) player)
+		i++;
+	return live[i];
+}
+
+/* Where the boards meet again once they've all stepped: in seat order,
+ * each one's hook calls are made and the garbage it sent is dealt out. */
+void FinishTick(Match *match)
+{
+	MatchHooks &hooks = match->hooks;
+
+	unsigned live[Match::max_players];
+	unsigned live_count = 0;
+	for(unsigned p = 0; p < match->player_count; p++){
+		if(!match->board[p].lost)
+			live[live_count++] = p;
+	}
+
+	for(unsigned p = 0; p < match->player_count; p++){
+		Match::Board &board = match->board[p];
+
+		for(unsigned e = 0; e < board.event_count; e++){
+			MatchEvent &event = board.events[e];
+			switch(event.kind){
+			case MatchEvent::POP:
+				if(hooks.on_pop)
+					hooks.on_pop(hooks.user, p, event.x, event.y, event.color);
+				break;
+			case MatchEvent::CHAIN:
+				if(hooks.on_chain)
+					hooks.on_chain(hooks.user, p, event.value);
+				break;
+			case MatchEvent::LOCKED:
+				if(hooks.on_locked)
+					hooks.on_locked(hooks.user, p, event.value);
+				break;
+			}
+		}
+		board.event_count = 0;
+
+		if(board.ojamms_outgoing){
+			int target = PickTarget(match, p, live, live_count);
+			if(target >= 0)
+				match->board[target].ojamms_pending += board.ojamms_outgoing;
+			board.ojamms_outgoing = 0;
+		}
+	}
+}
+
+// Board Pool ////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* Helper threads for StepMatch. They wait until RunBoards hands out a
+ * tick, then take boards off a shared counter until none are left and
+ * report back. The thread calling RunBoards takes boards as well, so a
+ * pool of n threads keeps n-1 helpers. One match at a time.
+ *
+ * A tick's boards can take only microseconds, less than a trip through a
+ * condition variable, so both sides spin on the atomics for a while
+ * before they block; not when there are more threads than cores, where
+ * the spinner would only sit on the core the other side needs. Whoever is about to block says so first (sleepers,
+ * caller_waiting) and the other side only takes the lock to wake it when
+ * it has; in the common case a tick is handed out and handed back without
+ * touching the mutex. */
+struct BoardPool{
+	std::vector<std::thread> helpers;
+	std::mutex lock;
+	std::condition_variable start;    // a new job, or stopping
+	std::condition_variable finished; // working reached 0
+	std::atomic<unsigned long long> job; // bumped for every tick handed out
+	std::atomic<unsigned> working;       // helpers yet to finish this job
+	std::atomic<unsigned> sleepers;      // helpers blocked on start
+	std::atomic<bool> caller_waiting;    // RunBoards blocked on finished
+	std::atomic<bool> stopping;
+	unsigned spin_tries;                 // 0 to block right away
+
+	Match *match;
+	const MatchInput *input;
+	std::atomic<unsigned> next_board;
+};
+
+/* One try of a spin: a pause for the first few, after that a yield, so a
+ * thread spinning on a crowded core doesn't hold up the one it's waiting
+ * for. */
+static inline void SpinPause(unsigned tries)
+{
+	if(tries < 64){
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	else
+		std::this_thread::yield();
+}
+
+static void TakeBoards(BoardPool *pool)
+{
+	Match *match = pool->match;
+	unsigned p;
+	while((p = pool->next_board++) < match->player_count)
+		StepBoard(match, p, pool->input->player[p]);
+}
+
+static void RunHelper(BoardPool *pool)
+{
+	unsigned long long seen = 0;
+
+	for(;;){
+		unsigned tries = 0;
+		while(pool->job == seen && !pool->stopping && tries < pool->spin_tries)
+			SpinPause(tries++);
+
+		if(pool->job == seen && !pool->stopping){
+			std::unique_lock<std::mutex> hold(pool->lock);
+			pool->sleepers++;
+			while(!pool->stopping && pool->job == seen)
+				pool->start.wait(hold);
+			pool->sleepers--;
+		}
+		if(pool->stopping)
+			return;
+		seen = pool->job;
+
+		TakeBoards(pool);
+
+		if(--pool->working == 0 && pool->caller_waiting){
+			std::lock_guard<std::mutex> hold(pool->lock);
+			pool->finished.notify_one();
+		}
+	}
+}
+
+/* A pool of threads threads, the caller's included; NULL if that's one or
+ * fewer, which StepMatch takes to mean stepping boards in turn. Allocates,
+ * so make it before a match starts. */
+BoardPool *StartBoardPool(unsigned threads)
+{
+	if(threads < 2)
+		return NULL;
+
+	BoardPool *pool = new BoardPool();
+	pool->job = 0;
+	pool->working = 0;
+	pool->sleepers = 0;
+	pool->caller_waiting = false;
+	pool->stopping = false;
+	pool->spin_tries = std::thread::hardware_concurrency() >= threads ? 256 : 0;
+	pool->match = NULL;
+	pool->input = NULL;
+	pool->next_board = 0;
+
+	for(unsigned t = 1; t < threads; t++)
+		pool->helpers.push_back(std::thread(RunHelper, pool));
+
+	return pool;
+}
+
+void StopBoardPool(BoardPool *pool)
+{
+	if(pool == NULL)
+		return;
+
+	pool->stopping = true;
+	{
+		std::lock_guard<std::mutex> hold(pool->lock);
+		pool->start.notify_all();
+	}
+
+	for(unsigned t = 0; t < pool->helpers.size(); t++)
+		pool->helpers[t].join();
+
+	delete pool;
+}
+
+/* Steps every board of match, spread over the pool, and returns once all
+ * of them are done. */
+void RunBoards(BoardPool *pool, Match *match, const MatchInput &input)
+{
+	pool->match = match;
+	pool->input = &input;
+	pool->next_board = 0;
+	pool->working = pool->helpers.size();
+	pool->job++;
+
+	if(pool->sleepers){
+		std::lock_guard<std::mutex> hold(pool->lock);
+		pool->start.notify_all();
+	}
+
+	TakeBoards(pool);
+
+	unsigned tries = 0;
+	while(pool->working && tries < pool->spin_tries)
+		SpinPause(tries++);
+
+	if(pool->working){
+		std::unique_lock<std::mutex> hold(pool->lock);
+		pool->caller_waiting = true;
+		while(pool->working)
+			pool->finished.wait(hold);
+		pool->caller_waiting = false;
+	}
+}
+
+// Debug /////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+#ifdef PUYO_COUNT_ALLOCATIONS
+
+/* Debug builds count every trip through operator new, so a tick or a frame
+ * can check it never touched the heap. Allocations SDL makes with malloc
+ * aren't seen. */
+static std::atomic<unsigned long long> allocations(0);
+
+void *operator new(std::size_t size)
+{
+	allocations++;
+
+	void *p = malloc(size ? size : 1);
+	if(p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	free(p);
+}
+
+#endif
+
+/* How many allocations there have been so far, when built with
+ * -DPUYO_COUNT_ALLOCATIONS. Always 0 otherwise. */
+unsigned long long AllocationCount()
+{
+#ifdef PUYO_COUNT_ALLOCATIONS
+	return allocations;
+#else
+	return 0;
+#endif
+}
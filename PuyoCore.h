@@ -0,0 +1,261 @@
+#ifndef PUYO_CORE_H
+#define PUYO_CORE_H
+
+/* The rules of the game, with no SDL in sight. A Match only moves forward
+ * when StepMatch is called, by a fixed tick of simulated time, so it can run
+ * under a window at 60Hz or headless as fast as the CPU allows. Randomness
+ * and anything the outside world should hear about go through MatchHooks. */
+
+#include "PuyoBoard.h"
+
+/* The board a match is played on. Any size a BoardEngine takes can be built
+ * in with -DPUYO_BOARD_WIDTH=8 -DPUYO_BOARD_HEIGHT=16 and the like. */
+#ifndef PUYO_BOARD_WIDTH
+#define PUYO_BOARD_WIDTH 6
+#endif
+#ifndef PUYO_BOARD_HEIGHT
+#define PUYO_BOARD_HEIGHT 12
+#endif
+
+typedef BoardEngine<PUYO_BOARD_WIDTH, PUYO_BOARD_HEIGHT> MatchEngine;
+typedef MatchEngine::GroupList GroupList;
+typedef MatchEngine::PlacementList PlacementList;
+typedef MatchEngine::DropResult DropResult;
+
+// Types /////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+enum PlayerType { NONE, HUM, CPU };
+
+struct Piece{
+	PieceColor color;
+	int x, y;
+};
+
+/* xoshiro128**: 16 bytes of state and a few ALU ops per draw. Every board
+ * owns its streams, so parallel matches never share or lock anything and a
+ * match replays exactly from its seed. */
+struct Rng{
+	unsigned s[4];
+};
+
+/* A couple are two active pieces that fall in tandum. They are kept out of
+ * the Bitboard until they lock. p[0] is the pivot; orientation says which
+ * side of it p[1] is on (LEFT, RIGHT, UP or DOWN). */
+struct Couple{
+	Piece *p[2];
+	Direction orientation;
+};
+
+/* What a seat wants this tick. left, right and down are held, rotate is a
+ * press that happened since the last step. Only HUM seats are read. */
+struct PlayerInput{
+	bool left, right, down, rotate;
+};
+
+/* Everything a match tells the outside world. Any hook may be NULL. */
+struct MatchHooks{
+	void *user;
+	void (*on_pop)(void *user, int player, int x, int y, PieceColor color);
+	void (*on_chain)(void *user, int player, int ojamms);
+	void (*on_locked)(void *user, int player, int chain); // chain is 0 if nothing popped
+};
+
+/* A hook call a board made during a tick. Boards step on their own, maybe
+ * on other threads, so what they have to say is written down and the
+ * hooks are called once the tick is over, in seat order. */
+struct MatchEvent{
+	enum Kind{ POP, CHAIN, LOCKED };
+
+	unsigned char kind;
+	unsigned char x, y;  // POP
+	PieceColor color;    // POP
+	int value;           // CHAIN: ojamms, LOCKED: chain
+};
+
+/* Threads StepMatch can spread a tick's boards over; see StartBoardPool. */
+struct BoardPool;
+
+/* Chains the CPU seats have already played out; see StartTranspositionTable
+ * in PuyoAI.h. */
+struct TranspositionTable;
+
+/* The trees and threads every MCTS seat of a match thinks with; see
+ * StartSearchPool in PuyoAI.h. */
+struct SearchPool;
+
+/* One seat's search while it runs, maybe in the background; see
+ * StartThinking in PuyoAI.cpp. */
+struct SearchSlot;
+
+/* How a CPU seat picks its moves: a beam search over the couples it can
+ * see, or Monte Carlo tree search with playouts past them. */
+enum AIMode { AI_BEAM, AI_MCTS };
+
+/* How hard a CPU seat thinks. The beam keeps the beam_width best boards at
+ * each step and looks depth couples ahead, the active one included. MCTS
+ * runs up to playouts playouts, each rollout_depth random couples past the
+ * ones it can see, placed at random or, with greedy_playouts, wherever
+ * looks best a move ahead. budget_us caps the wall-clock time per move
+ * either way; 0 means no cap, which keeps CPU play fully deterministic as
+ * long as the SearchPool MCTS seats think in has no helpers.
+ *
+ * A seat set to think in the background starts as soon as its couple
+ * spawns, on the SearchPool's helpers, and each tick only checks on it:
+ * the couple is steered once the search is done or budget_us is up. Without a pool that has helpers it
+ * thinks in the tick instead. A match whose ticks don't keep to the wall
+ * clock can set wait_for_thinking, so those ticks wait for the search
+ * rather than outrun it. */
+struct AIConfig{
+	AIMode mode;
+	unsigned beam_width;
+	unsigned depth;
+	unsigned playouts;
+	unsigned rollout_depth;
+	bool greedy_playouts;
+	bool background;
+	unsigned budget_us;
+};
+
+/* What a CPU seat has decided to do with its current couple. */
+struct AIPlan{
+	bool ready;
+	Placement target;
+	SearchSlot *job; // still thinking about it in the background, or NULL
+};
+
+/* How a CPU seat's thinking has gone over a match. A move whose search
+ * hadn't got through all of its levels or playouts when it had to be
+ * played, by its deadline or by the couple landing, is a deadline miss.
+ * Nodes are boards the beam scored, or MCTS playouts. */
+struct AIStats{
+	unsigned long long moves;
+	unsigned long long think_us;
+	unsigned long long nodes;
+	unsigned long long deadline_misses;
+};
+
+/* Any number of seats from 2 to max_players. Everything per seat is in
+ * fixed arrays of max_players, of which the first player_count are used. */
+struct Match {
+	static const unsigned max_players = 64;
+	static const unsigned tick_ms = 1000/60;
+	static const unsigned preview_count = 2; // couples each seat can see coming
+
+	unsigned player_count;
+	PlayerType player_types[max_players];
+
+	bool playing;
+	unsigned now;            // simulated ms, advanced tick_ms per step
+	unsigned time_limit_ms;  // ends the match in a draw once now gets there; 0 for never
+	unsigned long long seed; // everything random in the match follows from this
+
+	struct Board{
+		static const unsigned width_in_pieces = MatchEngine::width;
+		static const unsigned height_in_pieces = MatchEngine::height;
+
+		/* A board locks at most once a tick and every cell can pop only
+		 * once in the chain that follows, four or more to a group. */
+		static const unsigned max_events = width_in_pieces * height_in_pieces * 5 / 4 + 1;
+
+		/* Garbage comes down at most this many rows' worth a lock; the
+		 * rest stays queued in ojamms_pending. See OjammAttack. */
+		static const unsigned max_ojamm_rows = 5;
+
+		bool lost, won;
+		int score;
+		unsigned last_forced_move;
+		unsigned last_guided_move; // when a player is holding down
+		unsigned move_delay;
+
+		int ojamms_pending;  // queued against this board, offset by its own chains
+		int ojamms_outgoing; // sent this tick, dealt out when the tick ends
+		Bitboard b;
+
+		Rng pieces; // seeded the same on every board, so all get the same couples
+		Rng rng;    // this board's own draws: garbage columns and targets
+		PieceColor next[preview_count][2];
+
+		AIConfig ai;
+		AIPlan plan;
+		AIStats thought;
+
+		FallInfo fall;       // drops from the most recent lock, for drawing
+		unsigned fall_started;
+
+		Piece couple_pieces[2]; // storage for active_couple, reused for every
+		Couple couple;          // couple so nothing is allocated mid-match
+
+		unsigned event_count;
+		MatchEvent events[max_events]; // this tick's, for the hooks
+
+	} board[max_players];
+
+	Couple *active_couple[max_players]; // into board[p].couple, or NULL
+	MatchHooks hooks;
+	BoardPool *pool; // NULL steps the boards one after another
+	TranspositionTable *table; // shared by every CPU seat; NULL searches without one
+	SearchPool *search;        // where MCTS seats think; NULL plays them with the beam
+	bool wait_for_thinking;    // CPUTick waits out background searches rather than play on
+};
+
+struct MatchInput{
+	PlayerInput player[Match::max_players];
+};
+
+// Board (PuyoBoard.h) -----------------
+/* The match's board size, so callers needn't spell out MatchEngine. */
+inline BoardMask CellMask(int x, int y) { return MatchEngine::CellMask(x, y); }
+inline BoardMask Neighbours(BoardMask m) { return MatchEngine::Neighbours(m); }
+inline BoardMask FloodFill(BoardMask seed, BoardMask within) { return MatchEngine::FloodFill(seed, within); }
+inline unsigned FindPoppingGroups(const Bitboard &b, GroupList &list, BoardMask dirty = MatchEngine::full_mask) { return MatchEngine::FindPoppingGroups(b, list, dirty); }
+inline bool CellFree(const Bitboard &b, int x, int y) { return MatchEngine::CellFree(b, x, y); }
+inline void PlacePiece(Bitboard &b, int x, int y, PieceColor color) { MatchEngine::PlacePiece(b, x, y, color); }
+inline void AddPieces(Bitboard &b, BoardMask cells, PieceColor color) { MatchEngine::AddPieces(b, cells, color); }
+inline void RemovePieces(Bitboard &b, BoardMask cells) { MatchEngine::RemovePieces(b, cells); }
+inline BoardMask SettleBoard(Bitboard &b, FallInfo *landed) { return MatchEngine::SettleBoard(b, landed); }
+inline int ColumnHeight(const Bitboard &b, int x) { return MatchEngine::ColumnHeight(b, x); }
+inline int CountAdjacentPairs(BoardMask m) { return MatchEngine::CountAdjacentPairs(m); }
+inline bool CoupleFits(const Bitboard &b, int x, int y, Direction orientation) { return MatchEngine::CoupleFits(b, x, y, orientation); }
+inline bool RotateCouple(const Bitboard &b, int &x, int &y, Direction &orientation) { return MatchEngine::RotateCouple(b, x, y, orientation); }
+inline unsigned ListPlacements(const Bitboard &b, PieceColor c0, PieceColor c1, PlacementList &list) { return MatchEngine::ListPlacements(b, c0, c1, list); }
+inline bool DropCouple(Bitboard &b, const Placement &at, PieceColor c0, PieceColor c1) { return MatchEngine::DropCouple(b, at, c0, c1); }
+inline unsigned PopGroups(Bitboard &b, GroupList &popped, BoardMask dirty = MatchEngine::full_mask) { return MatchEngine::PopGroups(b, popped, dirty); }
+inline void ResolveChain(DropResult &result, BoardMask dirty = MatchEngine::full_mask) { MatchEngine::ResolveChain(result, dirty); }
+inline bool SimulateDrop(const Bitboard &b, const Placement &at, PieceColor c0, PieceColor c1, DropResult &result) { return MatchEngine::SimulateDrop(b, at, c0, c1, result); }
+
+// Random -------------------------------
+void SeedRng(Rng &, unsigned long long);
+unsigned NextRandom(Rng &);
+unsigned RandomBelow(Rng &, unsigned);
+
+// Match --------------------------------
+void InitMatch(Match*, unsigned long long, unsigned);
+void CleanMatch(Match*);
+void StepMatch(Match*, const MatchInput &);
+void StepBoard(Match*, int, const PlayerInput &);
+void FinishTick(Match*);
+Couple *GenerateNewCouple(Match*, int);
+void MoveActiveCouple(Match*, int, Direction);
+void LockActiveCouple(Match*, int);
+BoardMask FallPieces(Match*, int);
+bool CheckForCombos(Match*, int, BoardMask);
+int OjammsForGroup(int);
+void OjammAttack(Match *, int);
+void RecordEvent(Match *, int, const MatchEvent &);
+int PickTarget(Match *, int, const unsigned *, unsigned);
+
+// Board Pool ---------------------------
+BoardPool *StartBoardPool(unsigned);
+void StopBoardPool(BoardPool *);
+void RunBoards(BoardPool *, Match *, const MatchInput &);
+
+// Debug --------------------------------
+unsigned long long AllocationCount();
+
+// CPU (PuyoAI.cpp) ---------------------
+void CPUTick(Match*, int, PlayerInput &);
+void StartThinking(Match*, int);
+void StopThinking(Match*, int);
+
+#endif
@@ -0,0 +1,533 @@
+/* Headless batch simulator: plays full CPU matches through the same
+ * StepMatch the game uses, as fast as every core allows, and reports
+ * throughput and balance numbers.
+ *
+ *   g++ -O2 -pthread PuyoSim.cpp PuyoCore.cpp PuyoAI.cpp -o puyosim
+ *   ./puyosim -g 100000 -t 8 -s 1 -n 4
+ *
+ * Game i always plays with seed+i, so results don't depend on how the
+ * games were spread over threads. -b spreads each game's boards over that
+ * many threads as well, which doesn't change results either. That only
+ * pays off when each board's CPU is expensive to run, as with -a mcts:
+ * the beam's ticks take microseconds, about what handing each one out to
+ * the threads costs, so for it spend cores on -t instead. Every game
+ * shares one transposition table of -m megabytes (0 for none); a hit gives
+ * back exactly the chain a miss would have played out, so neither does
+ * that. -a mcts plays every seat with Monte Carlo tree search instead of
+ * the beam. -p lends it that many helper threads between all the games,
+ * which does change results: several threads share each tree. -k has
+ * seats think on those helpers in the background instead of in the tick.
+ * Ticks here don't keep to the wall clock, so they wait for each search
+ * to finish before its seat plays on: the numbers are the search's, not
+ * how far a free-running tick loop outran it.
+ * Two seats with the same board can offset each other's garbage forever,
+ * so a game still going after -l minutes of simulated time (60 by
+ * default, 0 for no limit) is stopped and counted apart from the draws.
+ * Games that end at all end well before that.
+ *
+ * -c plays nothing and checks the board engine instead: -g random boards
+ * at each of 6x12 and 8x16 are dropped on until they top out, and every
+ * step of every chain looks for groups both around what changed and over
+ * the whole board, which have to agree, and holds the board's Zobrist
+ * hash, kept up to date move by move, to one made from scratch. Then,
+ * on boards of the size the match is built for, a CPU seat is steered to
+ * every placement it could plan for and has to land where it planned.
+ * Exits 1 if anything ever disagrees. */
+
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "PuyoCore.h"
+#include "PuyoAI.h"
+
+// Types /////////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* A run of game numbers [next, end) packed in one word so the owner and
+ * thieves can both claim from it with a single compare-and-swap: the owner
+ * takes from the front, thieves take the back half. */
+struct WorkRange{
+	std::atomic<unsigned long long> span;
+};
+
+/* Totals one worker gathers; summed once every worker is done. */
+struct SimStats{
+	unsigned long long games;
+	unsigned long long ticks;
+	unsigned long long chains;      // locks that popped at least once
+	unsigned long long chain_links; // sum of those chains' lengths
+	unsigned long long wins[Match::max_players];
+	unsigned long long draws;
+	unsigned long long timeouts;    // games stopped at the -l time limit
+	AIStats thought[Match::max_players];
+};
+
+struct Worker{
+	WorkRange range;
+	SimStats stats;
+	char pad[64]; // keep neighbouring workers off each other's cache line
+};
+
+// Forward Declarations //////////////////////////////////
+//////////////////////////////////////////////////////////
+
+unsigned long long PackRange(unsigned, unsigned);
+bool TakeGame(WorkRange &, unsigned &);
+bool StealHalf(WorkRange &, unsigned &, unsigned &);
+void RunWorker(std::vector<Worker> *, unsigned, unsigned, unsigned, unsigned, TranspositionTable *, SearchPool *, AIMode, bool, unsigned);
+void PlayGame(unsigned, unsigned, SimStats &, BoardPool *, TranspositionTable *, SearchPool *, AIMode, bool, unsigned);
+void OnLocked(void*, int, int);
+unsigned long long RehashBoard(const Bitboard &);
+template<int W, int H> bool CheckEngine(unsigned long long, unsigned);
+bool CheckSteering(unsigned long long, unsigned);
+unsigned SteerEverywhere(unsigned long long, const Bitboard &, unsigned &);
+
+// Entry Point ///////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+	unsigned games = 10000;
+	unsigned threads = std::thread::hardware_concurrency();
+	unsigned seed = 1;
+	unsigned board_threads = 1;
+	unsigned players = 4;
+	unsigned table_mb = 16;
+	AIMode mode = AI_BEAM;
+	unsigned search_threads = 0;
+	bool background = false;
+	unsigned limit_minutes = 60;
+	bool check = false;
+
+	for(int i = 1; i < argc; i++){
+		if(i + 1 < argc && strcmp(argv[i], "-g") == 0)
+			games = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-t") == 0)
+			threads = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-s") == 0)
+			seed = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-b") == 0)
+			board_threads = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			players = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-m") == 0)
+			table_mb = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-a") == 0 && (strcmp(argv[i+1], "beam") == 0 || strcmp(argv[i+1], "mcts") == 0))
+			mode = strcmp(argv[++i], "mcts") == 0 ? AI_MCTS : AI_BEAM;
+		else if(i + 1 < argc && strcmp(argv[i], "-p") == 0)
+			search_threads = strtoul(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-l") == 0)
+			limit_minutes = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-k") == 0)
+			background = true;
+		else if(strcmp(argv[i], "-c") == 0)
+			check = true;
+		else{
+			std::cerr << "usage: " << argv[0] << " [-g games] [-t threads] [-s seed] [-b board threads] [-n players] [-m table megabytes] [-a beam|mcts] [-p search threads] [-k] [-l minutes] [-c]\n";
+			return -1;
+		}
+	}
+
+	if(check){
+		bool ok = CheckEngine<6,12>(seed, games);
+		ok &= CheckEngine<8,16>(seed, games);
+		ok &= CheckSteering(seed, games / 10 + 1);
+		return ok ? 0 : 1;
+	}
+
+	if(threads == 0)
+		threads = 1;
+	if(players < 2)
+		players = 2;
+	if(players > Match::max_players)
+		players = Match::max_players;
+
+	/* Deal the games out evenly up front; stealing evens out the rest. */
+	std::vector<Worker> workers(threads);
+	for(unsigned w = 0; w < threads; w++){
+		unsigned first = (unsigned long long) games * w / threads;
+		unsigned last = (unsigned long long) games * (w + 1) / threads;
+		workers[w].range.span = PackRange(first, last);
+		memset(&workers[w].stats, 0, sizeof(SimStats));
+	}
+
+	TranspositionTable *table = table_mb ? StartTranspositionTable((std::size_t) table_mb << 20) : NULL;
+
+	/* Every game thinks on the same helpers, and any board of any game
+	 * may be thinking at once: every seat, in the background. */
+	unsigned searches = threads * (background ? players : (board_threads > 1 ? board_threads : 1));
+	SearchPool *search = mode == AI_MCTS ? StartSearchPool(search_threads, searches) : NULL;
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> pool;
+	for(unsigned w = 0; w < threads; w++)
+		pool.push_back(std::thread(RunWorker, &workers, w, seed, players, board_threads, table, search, mode, background, limit_minutes * 60 * 1000));
+	for(unsigned w = 0; w < threads; w++)
+		pool[w].join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	SimStats total;
+	memset(&total, 0, sizeof(SimStats));
+	for(unsigned w = 0; w < threads; w++){
+		SimStats &s = workers[w].stats;
+		total.games += s.games;
+		total.ticks += s.ticks;
+		total.chains += s.chains;
+		total.chain_links += s.chain_links;
+		total.draws += s.draws;
+		total.timeouts += s.timeouts;
+		for(unsigned p = 0; p < players; p++){
+			total.wins[p] += s.wins[p];
+			total.thought[p].moves += s.thought[p].moves;
+			total.thought[p].think_us += s.thought[p].think_us;
+			total.thought[p].nodes += s.thought[p].nodes;
+			total.thought[p].deadline_misses += s.thought[p].deadline_misses;
+		}
+	}
+
+	printf("games:        %llu on %u threads in %.3fs\n", total.games, threads, seconds);
+	printf("games/sec:    %.1f\n", total.games / seconds);
+	printf("ticks/sec:    %.0f\n", total.ticks / seconds);
+	printf("avg chain:    %.3f (over %llu chains)\n", total.chains ? (double) total.chain_links / total.chains : 0.0, total.chains);
+	for(unsigned p = 0; p < players; p++)
+		printf("seat %u wins:  %.2f%%\n", p, total.games ? 100.0 * total.wins[p] / total.games : 0.0);
+	if(total.draws)
+		printf("draws:        %llu\n", total.draws);
+	if(total.timeouts)
+		printf("time limit:   %llu games stopped unfinished\n", total.timeouts);
+
+	/* Thinking time is summed over every game's threads, so nodes/sec is
+	 * per seat thinking, not for the whole run. */
+	for(unsigned p = 0; p < players; p++){
+		AIStats &t = total.thought[p];
+		printf("seat %u think: %.1fus a move, %.0f nodes/sec, %llu of %llu moves missed the deadline\n", p,
+		       t.moves ? (double) t.think_us / t.moves : 0.0, t.think_us ? t.nodes * 1e6 / t.think_us : 0.0,
+		       t.deadline_misses, t.moves);
+	}
+
+	StopSearchPool(search);
+
+	if(table){
+		TableStats t = GetTableStats(table);
+		printf("table:        %u MB, %.2f%% hits over %llu chains, %llu occupied misses, %llu collisions, %llu of %llu stores replaced\n",
+		       table_mb, t.probes ? 100.0 * t.hits / t.probes : 0.0, t.probes, t.occupied_misses, t.collisions, t.replaced, t.stores);
+		StopTranspositionTable(table);
+	}
+
+	return 0;
+}
+
+// Scheduling ////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+unsigned long long PackRange(unsigned next, unsigned end)
+{
+	return ((unsigned long long) next << 32) | end;
+}
+
+/* Owner side: claim the first game left in our own range. */
+bool TakeGame(WorkRange &range, unsigned &game)
+{
+	unsigned long long span = range.span.load();
+	for(;;){
+		unsigned next = span >> 32;
+		unsigned end = (unsigned) span;
+		if(next >= end)
+			return false;
+
+		if(range.span.compare_exchange_weak(span, PackRange(next + 1, end))){
+			game = next;
+			return true;
+		}
+	}
+}
+
+/* Thief side: take the back half of someone else's range. */
+bool StealHalf(WorkRange &victim, unsigned &first, unsigned &last)
+{
+	unsigned long long span = victim.span.load();
+	for(;;){
+		unsigned next = span >> 32;
+		unsigned end = (unsigned) span;
+		if(next >= end)
+			return false;
+
+		unsigned mid = next + (end - next) / 2;
+		if(victim.span.compare_exchange_weak(span, PackRange(next, mid))){
+			first = mid;
+			last = end;
+			return true;
+		}
+	}
+}
+
+void RunWorker(std::vector<Worker> *workers, unsigned self, unsigned seed, unsigned players, unsigned board_threads, TranspositionTable *table, SearchPool *search, AIMode mode, bool background, unsigned time_limit_ms)
+{
+	Worker &me = (*workers)[self];
+	unsigned count = workers->size();
+	BoardPool *boards = StartBoardPool(board_threads);
+
+	for(;;){
+		unsigned game;
+		while(TakeGame(me.range, game))
+			PlayGame(seed + game, players, me.stats, boards, table, search, mode, background, time_limit_ms);
+
+		/* Out of work: go round the others once looking for some. Games
+		 * only ever move to a thief that will play them, so quitting after
+		 * one empty lap can cost a little parallelism at the very end but
+		 * never drops a game. */
+		bool stole = false;
+		for(unsigned i = 1; i < count && !stole; i++){
+			unsigned first, last;
+			if(StealHalf((*workers)[(self + i) % count].range, first, last)){
+				me.range.span = PackRange(first, last);
+				stole = true;
+			}
+		}
+
+		if(!stole){
+			StopBoardPool(boards);
+			return;
+		}
+	}
+}
+
+// Simulation ////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+void OnLocked(void *user, int /*player*/, int chain)
+{
+	SimStats *stats = (SimStats*) user;
+	if(chain > 0){
+		stats->chains++;
+		stats->chain_links += chain;
+	}
+}
+
+void PlayGame(unsigned seed, unsigned players, SimStats &stats, BoardPool *boards, TranspositionTable *table, SearchPool *search, AIMode mode, bool background, unsigned time_limit_ms)
+{
+	Match match;
+	InitMatch(&match, seed, players);
+	match.hooks.user = &stats;
+	match.hooks.on_locked = OnLocked;
+	match.pool = boards;
+	match.table = table;
+	match.search = search;
+	match.wait_for_thinking = background;
+	match.time_limit_ms = time_limit_ms;
+	for(unsigned p = 0; p < match.player_count; p++){
+		match.board[p].ai.mode = mode;
+		match.board[p].ai.background = background;
+	}
+
+	MatchInput input;
+	memset(&input, 0, sizeof(MatchInput));
+
+	while(match.playing){
+		StepMatch(&match, input);
+		stats.ticks++;
+	}
+
+	bool winner = false;
+	for(unsigned p = 0; p < match.player_count; p++){
+		if(match.board[p].won){
+			stats.wins[p]++;
+			winner = true;
+		}
+	}
+	if(!winner){
+		if(match.time_limit_ms && match.now >= match.time_limit_ms)
+			stats.timeouts++;
+		else
+			stats.draws++;
+	}
+
+	/* Any search still running is called off and its move recorded
+	 * first, so the stats count it. */
+	CleanMatch(&match);
+
+	for(unsigned p = 0; p < match.player_count; p++){
+		AIStats &t = match.board[p].thought;
+		stats.thought[p].moves += t.moves;
+		stats.thought[p].think_us += t.think_us;
+		stats.thought[p].nodes += t.nodes;
+		stats.thought[p].deadline_misses += t.deadline_misses;
+	}
+
+	stats.games++;
+}
+
+// Self-check ////////////////////////////////////////////
+//////////////////////////////////////////////////////////
+
+/* b's Zobrist hash made from scratch, cell by cell. */
+unsigned long long RehashBoard(const Bitboard &b)
+{
+	unsigned long long hash = 0;
+	for(unsigned c = 0; c <= OJAMM; c++)
+		hash ^= HashCells(b.color[c], (PieceColor) c);
+	return hash;
+}
+
+/* Drops random couples on boards random garbage falls on too, one board
+ * after another until each tops out, and holds FindPoppingGroups given
+ * only what changed to what a scan of the whole board finds: the same
+ * groups, in the same order, with the same ojamms. After every change the
+ * hash the engine kept up to date has to match RehashBoard. */
+template<int W, int H>
+bool CheckEngine(unsigned long long seed, unsigned boards)
+{
+	typedef BoardEngine<W,H> Engine;
+
+	Rng rng;
+	SeedRng(rng, seed);
+
+	unsigned long long steps = 0;
+	unsigned long long group_misses = 0;
+	unsigned long long hash_misses = 0;
+
+	for(unsigned n = 0; n < boards; n++){
+		Bitboard b = Bitboard();
+
+		for(unsigned drop = 0; ; drop++){
+			/* Every so often a scattering of garbage lands on the stacks. */
+			if(drop % 4 == 3){
+				BoardMask added = 0;
+				for(int x = 0; x < W; x++){
+					int height = Engine::ColumnHeight(b, x);
+					if(height < H - 1 && RandomBelow(rng, 3) == 0)
+						added |= Engine::CellMask(x, H - 1 - height);
+				}
+				Engine::AddPieces(b, added, OJAMM);
+				hash_misses += b.hash != RehashBoard(b);
+			}
+
+			PieceColor c0 = (PieceColor) RandomBelow(rng, 5);
+			PieceColor c1 = (PieceColor) RandomBelow(rng, 5);
+			typename Engine::PlacementList places;
+			if(Engine::ListPlacements(b, c0, c1, places) == 0)
+				break;
+
+			BoardMask before = b.occupied;
+			Engine::DropCouple(b, places.placement[RandomBelow(rng, places.count)], c0, c1);
+			BoardMask dirty = b.occupied & ~before;
+			hash_misses += b.hash != RehashBoard(b);
+
+			for(;;){
+				typename Engine::GroupList changed, whole;
+				Engine::FindPoppingGroups(b, changed, dirty);
+				Engine::FindPoppingGroups(b, whole);
+				steps++;
+
+				bool same = changed.count == whole.count;
+				for(unsigned g = 0; same && g < whole.count; g++){
+					same = changed.group[g].color == whole.group[g].color
+					    && changed.group[g].cells == whole.group[g].cells
+					    && changed.group[g].ojamms == whole.group[g].ojamms;
+				}
+				group_misses += !same;
+
+				if(whole.count == 0)
+					break;
+				for(unsigned g = 0; g < whole.count; g++)
+					Engine::RemovePieces(b, whole.group[g].cells | whole.group[g].ojamms);
+				hash_misses += b.hash != RehashBoard(b);
+				dirty = Engine::SettleBoard(b, NULL);
+				hash_misses += b.hash != RehashBoard(b);
+			}
+		}
+	}
+
+	printf("check %dx%d:   %u boards, %llu chain steps, %llu group mismatches, %llu hash mismatches\n",
+	       W, H, boards, steps, group_misses, hash_misses);
+	return group_misses == 0 && hash_misses == 0;
+}
+
+/* Every couple the CPU is steered with lands where ListPlacements said it
+ * could go. Tried on a board with a wall next to the spawn that only the
+ * top row gets past, then on boards of garbage stacks of random heights. */
+bool CheckSteering(unsigned long long seed, unsigned boards)
+{
+	const int w = MatchEngine::width;
+	const int h = MatchEngine::height;
+
+	Rng rng;
+	SeedRng(rng, seed);
+
+	unsigned tried = 0;
+	unsigned misses = 0;
+
+	Bitboard wall = Bitboard();
+	for(int y = 1; y < h; y++)
+		AddPieces(wall, CellMask(MatchEngine::spawn_x - 1, y), OJAMM);
+	misses += SteerEverywhere(seed, wall, tried);
+
+	for(unsigned n = 0; n < boards; n++){
+		Bitboard b = Bitboard();
+		for(int x = 0; x < w; x++){
+			int height = RandomBelow(rng, h);
+			for(int y = h - height; y < h; y++)
+				AddPieces(b, CellMask(x, y), OJAMM);
+		}
+		misses += SteerEverywhere(seed + n, b, tried);
+	}
+
+	printf("check steering: %u boards, %u placements, %u landed elsewhere\n", boards + 1, tried, misses);
+	return misses == 0;
+}
+
+/* Plays seat 0's first couple on board once for every placement it could
+ * plan, with the plan set to that placement, and counts the ones where
+ * the couple didn't land the way DropCouple says it would. */
+unsigned SteerEverywhere(unsigned long long seed, const Bitboard &board, unsigned &tried)
+{
+	MatchInput input;
+	memset(&input, 0, sizeof(MatchInput));
+
+	PlacementList places;
+	places.count = 0;
+	unsigned misses = 0;
+
+	for(unsigned i = 0; i == 0 || i < places.count; i++){
+		Match match;
+		InitMatch(&match, seed, 2);
+		match.player_types[1] = HUM;
+		match.board[0].b = board;
+		StepMatch(&match, input); // deals the first couples
+
+		Couple *couple = match.active_couple[0];
+		if(couple == NULL)
+			return misses;
+		PieceColor c0 = couple->p[0]->color;
+		PieceColor c1 = couple->p[1]->color;
+		if(i == 0 && ListPlacements(board, c0, c1, places) == 0)
+			return misses;
+
+		Bitboard expected = board;
+		DropCouple(expected, places.placement[i], c0, c1);
+
+		match.board[0].plan.ready = true;
+		match.board[0].plan.target = places.placement[i];
+		while(match.playing && match.board[0].b.occupied == board.occupied)
+			StepMatch(&match, input);
+
+		tried++;
+		for(unsigned c = 0; c <= OJAMM; c++){
+			if(match.board[0].b.color[c] != expected.color[c]){
+				misses++;
+				break;
+			}
+		}
+		CleanMatch(&match);
+	}
+
+	return misses;
+}